@@ -14,6 +14,7 @@
 #include <esp_wifi.h>
 #include "AlpacaServer.h"
 #include "AlpacaDevice.h"
+#include <memory>
 #ifdef ALPACA_ENABLE_OTA_UPDATE
 #include "ElegantOTA.h"
 #endif
@@ -435,27 +436,40 @@ void AlpacaServer::Respond(AsyncWebServerRequest *request, AlpacaClient_t &clien
 // as_json_str==true will aditional quote the value
 void AlpacaServer::_respond(AsyncWebServerRequest *request, AlpacaClient_t &client, AlpacaRspStatus_t &rsp_status, const char *value, JsonValue_t jason_string_value)
 {
-    char response[2058 + 256];
-
     _server_transaction_id++;
-    if (jason_string_value == JsonValue_t::kNoValue)
-    {
-        // "{\n\t\"ClientTransactionID\": %i,\n\t\"ServerTransactionID\": %i,\n\t\"ErrorNumber\": %i,\n\t\"ErrorMessage\": \"%s\"\n}"
-        snprintf(response, sizeof(response), "{ \"ClientTransactionID\": %i, \"ServerTransactionID\": %i, \"ErrorNumber\": %i, \"ErrorMessage\": \"%s\"}",
-                 client.client_transaction_id, _server_transaction_id, rsp_status.error_code, rsp_status.error_msg);
-    }
-    else if (jason_string_value == JsonValue_t::kAsJsonStringValue)
-    {
-        // "{\n\t\"Value\": \"%s\",\n\t\"ClientTransactionID\": %i,\n\t\"ServerTransactionID\": %i,\n\t\"ErrorNumber\": %i,\n\t\"ErrorMessage\": \"%s\"\n}"
-        snprintf(response, sizeof(response), "{ \"Value\": \"%s\", \"ClientTransactionID\": %i, \"ServerTransactionID\": %i, \"ErrorNumber\": %i, \"ErrorMessage\": \"%s\"}",
-                 value, client.client_transaction_id, _server_transaction_id, rsp_status.error_code, rsp_status.error_msg);
-    }
-    else
+    auto format = [&](char *buf, size_t size)
     {
+        if (jason_string_value == JsonValue_t::kNoValue)
+        {
+            // "{\n\t\"ClientTransactionID\": %i,\n\t\"ServerTransactionID\": %i,\n\t\"ErrorNumber\": %i,\n\t\"ErrorMessage\": \"%s\"\n}"
+            return snprintf(buf, size, "{ \"ClientTransactionID\": %i, \"ServerTransactionID\": %i, \"ErrorNumber\": %i, \"ErrorMessage\": \"%s\"}",
+                            client.client_transaction_id, _server_transaction_id, rsp_status.error_code, rsp_status.error_msg);
+        }
+        else if (jason_string_value == JsonValue_t::kAsJsonStringValue)
+        {
+            // "{\n\t\"Value\": \"%s\",\n\t\"ClientTransactionID\": %i,\n\t\"ServerTransactionID\": %i,\n\t\"ErrorNumber\": %i,\n\t\"ErrorMessage\": \"%s\"\n}"
+            return snprintf(buf, size, "{ \"Value\": \"%s\", \"ClientTransactionID\": %i, \"ServerTransactionID\": %i, \"ErrorNumber\": %i, \"ErrorMessage\": \"%s\"}",
+                            value, client.client_transaction_id, _server_transaction_id, rsp_status.error_code, rsp_status.error_msg);
+        }
         // "{\n\t\"Value\": %s,\n\t\"ClientTransactionID\": %i,\n\t\"ServerTransactionID\": %i,\n\t\"ErrorNumber\": %i,\n\t\"ErrorMessage\": \"%s\"\n}"
-        snprintf(response, sizeof(response), "{ \"Value\": %s, \"ClientTransactionID\": %i, \"ServerTransactionID\": %i, \"ErrorNumber\": %i, \"ErrorMessage\": \"%s\"}",
-                 value, client.client_transaction_id, _server_transaction_id, rsp_status.error_code, rsp_status.error_msg);
+        return snprintf(buf, size, "{ \"Value\": %s, \"ClientTransactionID\": %i, \"ServerTransactionID\": %i, \"ErrorNumber\": %i, \"ErrorMessage\": \"%s\"}",
+                        value, client.client_transaction_id, _server_transaction_id, rsp_status.error_code, rsp_status.error_msg);
+    };
+
+    char response_buf[2058 + 256];
+    char *response = response_buf;
+    size_t response_size = sizeof(response_buf);
+    // measured first: responses larger than the stack buffer (e.g. action results or long
+    // error messages) are formatted on the heap instead of being cut
+    std::unique_ptr<char[]> large_response;
+    int response_len = format(nullptr, 0);
+    if (response_len >= 0 && static_cast<size_t>(response_len) >= response_size)
+    {
+        response_size = response_len + 1;
+        large_response.reset(new char[response_size]);
+        response = large_response.get();
     }
+    format(response, response_size);
     request->send((int32_t)rsp_status.http_status, kAlpacaJsonType, response);
     DBG_RESPOND_VALUE;
 }
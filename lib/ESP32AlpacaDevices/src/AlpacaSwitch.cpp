@@ -3,6 +3,7 @@
   Copyright 2024-2025 peter_n@gmx.de. All rights reserved.
 **************************************************************************************************/
 #include "AlpacaSwitch.h"
+#include <memory>
 
 AlpacaSwitch::AlpacaSwitch(uint32_t num_of_switch_devices)
 {
@@ -134,6 +135,7 @@ void AlpacaSwitch::_alpacaGetSwitch(AsyncWebServerRequest *request)
     DBG_SWITCH_GET_SWITCH
     _service_counter++;
     _alpaca_server->RspStatusClear(_rsp_status);
+    _refreshSwitchDevices();
     bool bool_value = false;
     uint32_t id = 0;
     uint32_t client_idx = checkClientDataAndConnection(request, client_idx, Spelling_t::kIgnoreCase);
@@ -209,6 +211,7 @@ void AlpacaSwitch::_alpacaGetSwitchValue(AsyncWebServerRequest *request)
     DBG_SWITCH_GET_SWITCH_VALUE;
     _service_counter++;
     _alpaca_server->RspStatusClear(_rsp_status);
+    _refreshSwitchDevices();
     double double_value = 0.0;
     uint32_t id = 0;
     uint32_t client_idx = checkClientDataAndConnection(request, client_idx, Spelling_t::kIgnoreCase);
@@ -329,6 +332,7 @@ void AlpacaSwitch::_alpacaGetStateChangeComplete(AsyncWebServerRequest *request)
     DBG_SWITCH_GET_CAN_ASYNC
     _service_counter++;
     _alpaca_server->RspStatusClear(_rsp_status);
+    _refreshSwitchDevices();
     bool state_change_complete = false;
     uint32_t id = 0;
     uint32_t client_idx = checkClientDataAndConnection(request, client_idx, Spelling_t::kIgnoreCase);
@@ -336,9 +340,15 @@ void AlpacaSwitch::_alpacaGetStateChangeComplete(AsyncWebServerRequest *request)
     {
         if (_getAndCheckId(request, id, Spelling_t::kIgnoreCase))
         {
+            if (_p_switch_devices[id].has_been_cancelled == true)
+            {
+                MYTHROW_RspStatusOperationCancelled(request, _rsp_status, GetSwitchName(id));
+            }
             state_change_complete = _p_switch_devices[id].state_change_complete;
         }
     }
+
+mycatch:
     _alpaca_server->Respond(request, _clients[client_idx], _rsp_status, state_change_complete);
     DBG_END
 }
@@ -476,6 +486,7 @@ void AlpacaSwitch::_alpacaPutCancleAsync(AsyncWebServerRequest *request)
         {
             if (GetStateChangeComplete(id) == false) {
                 _p_switch_devices[id].has_been_cancelled = true;
+                _cancelAsync(id);
             }
         }
     }
@@ -526,8 +537,8 @@ void AlpacaSwitch::AlpacaPutAction(AsyncWebServerRequest *request)
     uint32_t client_idx = 0;
     _alpaca_server->RspStatusClear(_rsp_status);
     char action[64] = {0};
-    char parameters[128] = {0};
-    char str_response[1024] = {0};
+    char parameters[kSwitchActionParametersSize] = {0};
+    std::string str_response;
 
     if ((client_idx = checkClientDataAndConnection(request, client_idx, Spelling_t::kStrict)) == 0 && _clients[client_idx].client_id != ALPACA_CONNECTION_LESS_CLIENT_ID)
         goto mycatch;
@@ -538,10 +549,10 @@ void AlpacaSwitch::AlpacaPutAction(AsyncWebServerRequest *request)
     if (_alpaca_server->GetParam(request, "Parameters", parameters, sizeof(parameters), Spelling_t::kStrict) == false)
         MYTHROW_RspStatusParameterNotFound(request, _rsp_status, "Action");
 
-    if (_putAction(action, parameters, str_response, sizeof(str_response)) == false)
+    if (_putAction(action, parameters, str_response) == false)
         MYTHROW_RspStatusCommandStringInvalid(request, _rsp_status, parameters);
 
-    _alpaca_server->Respond(request, _clients[client_idx], _rsp_status, str_response, JsonValue_t::kAsPlainStringValue);
+    _alpaca_server->Respond(request, _clients[client_idx], _rsp_status, str_response.c_str(), JsonValue_t::kAsPlainStringValue);
 
     DBG_END;
     return;
@@ -663,6 +674,8 @@ bool const AlpacaSwitch::_getDeviceStateList(size_t buf_len, char *buf)
     size_t len = 0;
     const size_t max_json_len = 128;    // max len of one json element
 
+    _refreshSwitchDevices();
+
     for (unsigned id = 0; id < GetMaxSwitch(); id++)
     {
         if (GetStateChangeComplete(id))
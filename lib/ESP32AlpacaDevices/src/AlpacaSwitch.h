@@ -8,9 +8,11 @@
 **************************************************************************************************/
 #pragma once
 #include "AlpacaDevice.h"
+#include <string>
 
 const size_t kSwitchNameSize = 32;         // Max. size of switch device name incl. '\0'
 const size_t kSwitchDescriptionSize = 128; // Max. size of switch description incl. '\0'
+const size_t kSwitchActionParametersSize = 512; // Max. size of action parameters incl. '\0'; longer ones are cut
 
 /**
  * @brief Switch device change type: Asynchron/synchron
@@ -90,17 +92,27 @@ private:
     void AlpacaPutCommandString(AsyncWebServerRequest *request);
 
     /* devices specific handlers and helpers */
-    virtual const bool _putAction(const char *const action, const char *const parameters, char *string_response, size_t string_response_size) = 0;
+    virtual const bool _putAction(const char *const action, const char *const parameters, std::string &string_response) = 0; // value sized by the device
     virtual const bool _putCommandBlind(const char *const command, const char *const raw, bool &bool_response) = 0;
     virtual const bool _putCommandBool(const char *const command, const char *const raw, bool &bool_response) = 0;
     virtual const bool _putCommandString(const char *const command_str, const char *const raw, char *string_response, size_t string_response_size) = 0;
 
     virtual const char *const _getFirmwareVersion() { return "-"; };
+    /**
+     * @brief Called by the GET handlers before switch values are read. Drivers which
+     *        maintain the switch states in another task update the switch devices here.
+     */
+    virtual void _refreshSwitchDevices() {};
     /**
      * @brief Write to physical device
      * @return true/false - write was succesful/not succesfull
      */
     virtual const bool _writeSwitchValue(uint32_t id, double value, SwitchAsyncType_t async_type) = 0;
+    /**
+     * @brief Called by cancelasync for a switch whose asynchronous change is not complete yet.
+     *        Drivers drop the change if it has not reached the physical device.
+     */
+    virtual void _cancelAsync(uint32_t id) {};
 
     // private helpers
     bool _getAndCheckId(AsyncWebServerRequest *request, uint32_t &id, Spelling_t spelling);
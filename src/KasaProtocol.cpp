@@ -0,0 +1,312 @@
+/**************************************************************************************************
+  Filename:       KasaProtocol.cpp
+  Revised:        $Date: 2025-10-24$
+  Version:        Version: 2.2.0
+  Description:    Kasa Smart Plug wire format - XOR autokey codec and frame buffers
+
+  Copyright 2024-2025. All rights reserved.
+**************************************************************************************************/
+#include "KasaProtocol.h"
+#include <string.h>
+#include <algorithm>
+
+uint8_t KasaRxBuffer::_pool[kKasaRxBuffers][kKasaRxFrameSize];
+bool KasaRxBuffer::_pool_in_use[kKasaRxBuffers] = {};
+portMUX_TYPE KasaRxBuffer::_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Each cipher byte becomes the key for the next one
+ */
+void kasa_encrypt(uint8_t *buf, size_t len)
+{
+    uint8_t key = kKasaCipherKey;
+    for (size_t i = 0; i < len; i++) {
+        key ^= buf[i];
+        buf[i] = key;
+    }
+}
+
+/**
+ * @brief Plain byte i only depends on cipher bytes i and i-1, so whole 32-bit words are
+ *        decrypted at once: w ^ ((w << 8) | previous cipher byte). Unaligned head and the
+ *        tail are handled byte by byte.
+ */
+uint8_t kasa_decrypt(uint8_t *buf, size_t len, uint8_t key)
+{
+    size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i < len && (reinterpret_cast<uintptr_t>(buf + i) & 3) != 0; i++) {
+        uint8_t c = buf[i];
+        buf[i] = c ^ key;
+        key = c;
+    }
+    uint32_t carry = key;
+    for (; i + 4 <= len; i += 4) {
+        uint32_t w;
+        memcpy(&w, buf + i, 4);
+        uint32_t plain = w ^ ((w << 8) | carry);
+        carry = w >> 24;
+        memcpy(buf + i, &plain, 4);
+    }
+    key = static_cast<uint8_t>(carry);
+#endif
+    for (; i < len; i++) {
+        uint8_t c = buf[i];
+        buf[i] = c ^ key;
+        key = c;
+    }
+    return key;
+}
+
+/**
+ * @brief Keeps relay states, the identification used by discovery and the error codes; the
+ *        rest of get_sysinfo (location, firmware, LED, ...) is skipped while parsing
+ */
+const JsonDocument &kasa_reply_filter()
+{
+    static const JsonDocument filter = [] {
+        JsonDocument doc;
+        doc["error_code"] = true;
+        JsonObject sysinfo = doc["system"]["get_sysinfo"].to<JsonObject>();
+        sysinfo["err_code"] = true;
+        sysinfo["relay_state"] = true;
+        sysinfo["deviceId"] = true;
+        sysinfo["alias"] = true;
+        sysinfo["model"] = true;
+        JsonObject child = sysinfo["children"][0].to<JsonObject>();
+        child["id"] = true;
+        child["state"] = true;
+        child["alias"] = true;
+        doc["system"]["set_relay_state"]["err_code"] = true;
+        return doc;
+    }();
+    return filter;
+}
+
+int KasaDecryptReader::read()
+{
+    char c;
+    return readBytes(&c, 1) == 1 ? static_cast<uint8_t>(c) : -1;
+}
+
+size_t KasaDecryptReader::readBytes(char *buf, size_t len)
+{
+    size_t got = _src.readBytes(buf, std::min(len, _remaining));
+    _remaining -= got;
+    _key = kasa_decrypt(reinterpret_cast<uint8_t *>(buf), got, _key);
+    return got;
+}
+
+/**
+ * @brief Feed the rest of the payload to scanner in small chunks
+ * @return bytes left unread (stream timeout)
+ */
+size_t KasaDecryptReader::ScanAll(KasaRelayScanner &scanner)
+{
+    char chunk[128];
+    while (_remaining > 0) {
+        size_t got = readBytes(chunk, sizeof(chunk));
+        if (got == 0) break;
+        scanner.Feed(reinterpret_cast<uint8_t *>(chunk), got);
+    }
+    return _remaining;
+}
+
+/**
+ * @brief Tokenizes without recursion. Containers are tagged with their position in the reply
+ *        (root, system, get_sysinfo, children, child) so nested fields with the same name
+ *        (e.g. next_action) are ignored. Non-integer numbers are truncated, strings longer
+ *        than kKasaScanStringSize are cut.
+ */
+void KasaRelayScanner::Feed(const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len && !_complete && !_invalid; i++) {
+        char c = static_cast<char>(buf[i]);
+
+        if (_in_string) {
+            if (_escape) {
+                _escape = false;
+            } else if (c == '\\') {
+                _escape = true;
+                continue;
+            } else if (c == '"') {
+                _in_string = false;
+                _string[_string_len] = '\0';
+                if (_depth > 0 && _depth <= kKasaScanMaxDepth && _object[_depth - 1] && _expect_key) {
+                    memcpy(_key, _string, _string_len + 1);
+                } else {
+                    _value(true);
+                }
+                continue;
+            }
+            if (_string_len < kKasaScanStringSize - 1) _string[_string_len++] = c;
+            continue;
+        }
+
+        if (_in_number) {
+            if (c >= '0' && c <= '9') {
+                if (_number < 100000000) _number = _number * 10 + (c - '0');
+                continue;
+            }
+            if (c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+                continue; // fraction / exponent: keep the integer part
+            }
+            _in_number = false;
+            if (_negative) _number = -_number;
+            _value(false);
+        }
+
+        switch (c) {
+        case '{':
+        case '[':
+            _open(c == '{');
+            break;
+        case '}':
+        case ']':
+            _close();
+            break;
+        case '"':
+            _in_string = true;
+            _string_len = 0;
+            break;
+        case ':':
+            _expect_key = false;
+            break;
+        case ',':
+            _expect_key = _depth > 0 && _depth <= kKasaScanMaxDepth && _object[_depth - 1];
+            break;
+        case '-':
+            _in_number = true;
+            _negative = true;
+            _number = 0;
+            break;
+        default:
+            if (c >= '0' && c <= '9') {
+                _in_number = true;
+                _negative = false;
+                _number = c - '0';
+            }
+            // true / false / null and whitespace carry nothing we need
+            break;
+        }
+    }
+}
+
+void KasaRelayScanner::_open(bool object)
+{
+    // containers below kKasaScanMaxDepth are not tracked: their keys and values are skipped
+    Context parent = (_depth > 0 && _depth <= kKasaScanMaxDepth) ? _ctx[_depth - 1] : kOther;
+    Context ctx = kOther;
+    if (_depth == 0) {
+        if (!object) _invalid = true;
+        ctx = kRoot;
+    } else if (parent == kRoot && object && strcmp(_key, "system") == 0) {
+        ctx = kSystem;
+    } else if (parent == kSystem && object && strcmp(_key, "get_sysinfo") == 0) {
+        ctx = kSysinfo;
+        _has_sysinfo = true;
+    } else if (parent == kSysinfo && !object && strcmp(_key, "children") == 0) {
+        ctx = kChildren;
+    } else if (parent == kChildren && object && _child_count < kKasaScanMaxChildren) {
+        ctx = kChild;
+        _children[_child_count].id[0] = '\0';
+        _children[_child_count].state = -1;
+        _child_count++;
+    }
+
+    if (_depth < kKasaScanMaxDepth) {
+        _ctx[_depth] = ctx;
+        _object[_depth] = object;
+    }
+    _depth++;
+    _expect_key = object && _depth <= kKasaScanMaxDepth;
+}
+
+void KasaRelayScanner::_close()
+{
+    if (_depth == 0) {
+        _invalid = true;
+        return;
+    }
+    _depth--;
+    _expect_key = false;
+    if (_depth == 0) _complete = true;
+}
+
+void KasaRelayScanner::_value(bool is_string)
+{
+    if (_depth == 0 || _depth > kKasaScanMaxDepth) return;
+    Context ctx = _ctx[_depth - 1];
+    if (!_object[_depth - 1]) return;
+
+    if (ctx == kRoot && !is_string && strcmp(_key, "error_code") == 0) {
+        _error_code = _number;
+    } else if (ctx == kSysinfo) {
+        if (!is_string && strcmp(_key, "relay_state") == 0) _relay_state = _number;
+        else if (!is_string && strcmp(_key, "err_code") == 0) _err_code = _number;
+        else if (is_string && strcmp(_key, "deviceId") == 0) memcpy(_device_id, _string, _string_len + 1);
+    } else if (ctx == kChild) {
+        Child &child = _children[_child_count - 1];
+        if (is_string && strcmp(_key, "id") == 0) memcpy(child.id, _string, _string_len + 1);
+        else if (!is_string && strcmp(_key, "state") == 0) child.state = _number;
+    }
+}
+
+size_t kasa_encode_datagram(JsonDocument &doc, uint8_t *buf, size_t buf_size)
+{
+    size_t len = measureJson(doc);
+    if (len + 1 > buf_size) return 0; // serializeJson() adds a terminator
+    len = serializeJson(doc, reinterpret_cast<char *>(buf), buf_size);
+    kasa_encrypt(buf, len);
+    return len;
+}
+
+size_t kasa_encode_frame(JsonDocument &doc, uint8_t *frame, size_t frame_size)
+{
+    if (frame_size <= kKasaFrameHeaderSize) return 0;
+    size_t len = kasa_encode_datagram(doc, frame + kKasaFrameHeaderSize, frame_size - kKasaFrameHeaderSize);
+    if (len == 0) return 0;
+    frame[0] = static_cast<uint8_t>(len >> 24);
+    frame[1] = static_cast<uint8_t>(len >> 16);
+    frame[2] = static_cast<uint8_t>(len >> 8);
+    frame[3] = static_cast<uint8_t>(len);
+    return kKasaFrameHeaderSize + len;
+}
+
+KasaRxBuffer::KasaRxBuffer(bool acquire)
+{
+    if (acquire) Acquire();
+}
+
+KasaRxBuffer::~KasaRxBuffer()
+{
+    Release();
+}
+
+void KasaRxBuffer::Acquire()
+{
+    if (_data) return;
+    portENTER_CRITICAL(&_lock);
+    for (size_t u = 0; u < kKasaRxBuffers && _slot < 0; u++) {
+        if (!_pool_in_use[u]) {
+            _pool_in_use[u] = true;
+            _slot = static_cast<int>(u);
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+    _data = (_slot >= 0) ? _pool[_slot] : new uint8_t[kKasaRxFrameSize];
+}
+
+void KasaRxBuffer::Release()
+{
+    if (!_data) return;
+    if (_slot < 0) {
+        delete[] _data;
+    } else {
+        portENTER_CRITICAL(&_lock);
+        _pool_in_use[_slot] = false;
+        portEXIT_CRITICAL(&_lock);
+        _slot = -1;
+    }
+    _data = nullptr;
+}
@@ -0,0 +1,148 @@
+/**************************************************************************************************
+  Filename:       KasaProtocol.h
+  Revised:        $Date: 2025-10-24$
+  Version:        Version: 2.2.0
+  Description:    Kasa Smart Plug wire format - XOR autokey codec and frame buffers
+
+  Copyright 2024-2025. All rights reserved.
+**************************************************************************************************/
+#pragma once
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+const uint8_t kKasaCipherKey = 171;       // initial key of the XOR autokey cipher
+const size_t kKasaFrameHeaderSize = 4;    // big-endian payload length in front of TCP frames
+const size_t kKasaTxFrameSize = 512;      // request frames are built on the stack
+const size_t kKasaRxFrameSize = 4096;     // receive buffer; larger replies are parsed from the socket
+const size_t kKasaMaxPayloadSize = 65536; // longer length prefixes are treated as corrupt
+const size_t kKasaScanMaxChildren = 8;    // outlets tracked by KasaRelayScanner
+const size_t kKasaScanStringSize = 48;    // child ids are the 40 character deviceId plus 2 digits
+const size_t kKasaScanMaxDepth = 8;       // deeper nesting is skipped without tracking
+const size_t kKasaRxBuffers = 4;          // in-flight KasaRequests
+
+// Encrypt / decrypt len bytes in place; kasa_decrypt() returns the key for the next chunk of the payload
+void kasa_encrypt(uint8_t *buf, size_t len);
+uint8_t kasa_decrypt(uint8_t *buf, size_t len, uint8_t key = kKasaCipherKey);
+
+// Filter for deserializeJson(): the reply fields used by polls, switching and discovery
+const JsonDocument &kasa_reply_filter();
+
+// Serialize doc into frame as length prefix + encrypted payload; returns frame length, 0 if too large
+size_t kasa_encode_frame(JsonDocument &doc, uint8_t *frame, size_t frame_size);
+// Serialize doc into buf as encrypted payload without prefix (UDP); returns payload length, 0 if too large
+size_t kasa_encode_datagram(JsonDocument &doc, uint8_t *buf, size_t buf_size);
+
+/**
+ * @brief Single pass scanner for the relay states of a get_sysinfo reply (error_code,
+ *        get_sysinfo err_code / relay_state / deviceId and children[].id/state) without
+ *        building a JSON document. Decrypted bytes are fed in chunks of any size.
+ */
+class KasaRelayScanner
+{
+public:
+    struct Child
+    {
+        char id[kKasaScanStringSize];
+        int state;
+    };
+
+private:
+    enum Context : uint8_t
+    {
+        kOther,
+        kRoot,
+        kSystem,
+        kSysinfo,
+        kChildren,
+        kChild
+    };
+
+    Context _ctx[kKasaScanMaxDepth];
+    bool _object[kKasaScanMaxDepth];
+    size_t _depth = 0;
+    bool _expect_key = false;
+    bool _complete = false;
+    bool _invalid = false;
+
+    bool _in_string = false;
+    bool _escape = false;
+    char _string[kKasaScanStringSize] = "";
+    size_t _string_len = 0;
+    char _key[kKasaScanStringSize] = "";
+
+    bool _in_number = false;
+    bool _negative = false;
+    int32_t _number = 0;
+
+    int _error_code = 0;
+    int _err_code = 0;
+    int _relay_state = -1;
+    bool _has_sysinfo = false;
+    char _device_id[kKasaScanStringSize] = "";
+    Child _children[kKasaScanMaxChildren];
+    size_t _child_count = 0;
+
+    void _open(bool object);
+    void _close();
+    void _value(bool is_string);
+
+public:
+    void Feed(const uint8_t *buf, size_t len);
+
+    const bool IsComplete() { return _complete && !_invalid; };
+    const bool HasSysinfo() { return _has_sysinfo; };
+    const int GetErrorCode() { return _error_code != 0 ? _error_code : _err_code; };
+    const int GetRelayState() { return _relay_state; };
+    const char *GetDeviceId() { return _device_id; };
+    const size_t GetChildCount() { return _child_count; };
+    const Child &GetChild(size_t u) { return _children[u]; };
+};
+
+/**
+ * @brief Reader for deserializeJson() that decrypts a payload of len bytes while it is read
+ *        from src, so the payload never has to be buffered as a whole. Reads block for at most
+ *        the stream timeout of src.
+ */
+class KasaDecryptReader
+{
+private:
+    Stream &_src;
+    size_t _remaining;
+    uint8_t _key = kKasaCipherKey;
+
+public:
+    KasaDecryptReader(Stream &src, size_t len) : _src(src), _remaining(len) {};
+
+    int read();
+    size_t readBytes(char *buf, size_t len);
+    size_t ScanAll(KasaRelayScanner &scanner);
+    const size_t GetRemaining() { return _remaining; };
+};
+
+/**
+ * @brief Receive buffer of kKasaRxFrameSize bytes taken from a small static pool between
+ *        Acquire() and Release() (by default for the lifetime of the object). Falls back to
+ *        the heap only when all static buffers are busy.
+ */
+class KasaRxBuffer
+{
+private:
+    static uint8_t _pool[kKasaRxBuffers][kKasaRxFrameSize];
+    static bool _pool_in_use[kKasaRxBuffers];
+    static portMUX_TYPE _lock;
+
+    uint8_t *_data = nullptr;
+    int _slot = -1;
+
+public:
+    explicit KasaRxBuffer(bool acquire = true);
+    ~KasaRxBuffer();
+    KasaRxBuffer(const KasaRxBuffer &) = delete;
+    KasaRxBuffer &operator=(const KasaRxBuffer &) = delete;
+
+    void Acquire();
+    void Release();
+    uint8_t *Data() { return _data; };
+    char *Chars() { return reinterpret_cast<char *>(_data); };
+    const size_t Capacity() { return kKasaRxFrameSize; };
+};
@@ -0,0 +1,616 @@
+/**************************************************************************************************
+  Filename:       KasaTransport.cpp
+  Revised:        $Date: 2025-10-23$
+  Version:        Version: 2.2.0
+  Description:    TCP transport for Kasa Smart Plugs - persistent per-plug connection pool
+                  and non-blocking request state machine
+
+  Copyright 2024-2025. All rights reserved.
+**************************************************************************************************/
+#include "KasaTransport.h"
+#include <SLog.h>
+#include <lwip/sockets.h>
+#include <algorithm>
+
+KasaConnectionPool g_kasa_pool;
+
+KasaConnectionPool::Slot *KasaConnectionPool::_slotOf(WiFiClient *client)
+{
+    for (size_t u = 0; u < kKasaPoolMaxSockets; u++) {
+        if (&_slots[u].client == client) return &_slots[u];
+    }
+    return nullptr;
+}
+
+void KasaConnectionPool::_close(Slot &slot)
+{
+    if (slot.connecting) {
+        close(slot.connect_fd);
+        slot.connecting = false;
+    }
+    slot.client.stop();
+    slot.open = false;
+}
+
+/**
+ * @brief Start a TCP connect without waiting for the handshake; PollConnect() completes it
+ */
+bool KasaConnectionPool::_startConnect(Slot &slot, uint32_t timeout_ms)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kKasaPort);
+    if (inet_pton(AF_INET, slot.ip.c_str(), &addr.sin_addr) != 1) return false;
+
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) return false;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return false;
+    }
+    slot.connect_fd = fd;
+    slot.connect_start_ms = millis();
+    slot.connect_timeout_ms = timeout_ms;
+    slot.connecting = true;
+    return true;
+}
+
+void KasaConnectionPool::_free(Slot &slot)
+{
+    portENTER_CRITICAL(&_lock);
+    slot.in_use = false;
+    portEXIT_CRITICAL(&_lock);
+}
+
+void KasaConnectionPool::_count(uint32_t &counter)
+{
+    portENTER_CRITICAL(&_lock);
+    counter++;
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * @brief Hand out a connected socket for ip. Reuses an open socket when possible,
+ *        otherwise takes a free slot or evicts the least recently used idle one.
+ *        The socket has to be given back with Release() or Invalidate().
+ *        A new connection is only started (kConnecting) and has to be completed with
+ *        PollConnect().
+ */
+KasaPoolResult_t KasaConnectionPool::Acquire(const std::string &ip, WiFiClient *&client, uint32_t timeout_ms)
+{
+    Slot *slot = nullptr;
+    bool reuse = false;
+    client = nullptr;
+
+    portENTER_CRITICAL(&_lock);
+    for (size_t u = 0; u < _max_sockets && !slot; u++) {
+        if (!_slots[u].in_use && _slots[u].open && _slots[u].ip == ip) {
+            slot = &_slots[u];
+            reuse = true;
+        }
+    }
+    for (size_t u = 0; u < _max_sockets && !slot; u++) {
+        if (!_slots[u].in_use && !_slots[u].open) slot = &_slots[u];
+    }
+    // cap reached: take the least recently used idle socket
+    for (size_t u = 0; u < _max_sockets && !reuse; u++) {
+        if (_slots[u].in_use || !_slots[u].open) continue;
+        if (!slot || (slot->open && (int32_t)(_slots[u].last_used_ms - slot->last_used_ms) < 0)) slot = &_slots[u];
+    }
+    if (slot) slot->in_use = true;
+    portEXIT_CRITICAL(&_lock);
+
+    if (!slot) {
+#ifdef DEBUG_KASA_TRANSPORT
+        SLOG_DEBUG_PRINTF("Connection pool exhausted (%u sockets in use)\n", static_cast<unsigned>(_max_sockets));
+#endif
+        return KasaPoolResult_t::kExhausted;
+    }
+
+    if (reuse) {
+        if (slot->client.connected()) {
+            _count(_stats.hits);
+            slot->last_used_ms = millis();
+            client = &slot->client;
+            return KasaPoolResult_t::kHit;
+        }
+        // plug closed the socket while it was parked in the pool
+        _close(*slot);
+        _count(_stats.reconnects);
+    } else {
+        if (slot->open) {
+            // cap reached: recycle the least recently used idle socket
+#ifdef DEBUG_KASA_TRANSPORT
+            SLOG_DEBUG_PRINTF("Evicting pooled socket to %s for %s\n", slot->ip.c_str(), ip.c_str());
+#endif
+            _close(*slot);
+            _count(_stats.evictions);
+        }
+        _count(_stats.misses);
+        slot->ip = ip;
+    }
+    if (!_startConnect(*slot, timeout_ms)) {
+        _free(*slot);
+        return KasaPoolResult_t::kConnectFailed;
+    }
+    client = &slot->client;
+    return KasaPoolResult_t::kConnecting;
+}
+
+/**
+ * @brief Check a connect started by Acquire() or Reconnect() without waiting.
+ *        Returns kConnecting while the handshake is pending and kMiss once connected. On
+ *        kConnectFailed the socket has been given back and no longer belongs to the caller.
+ */
+KasaPoolResult_t KasaConnectionPool::PollConnect(WiFiClient *client)
+{
+    Slot *slot = _slotOf(client);
+    if (!slot) return KasaPoolResult_t::kConnectFailed;
+    if (!slot->connecting) return slot->open ? KasaPoolResult_t::kMiss : KasaPoolResult_t::kConnectFailed;
+
+    fd_set write_fds;
+    FD_ZERO(&write_fds);
+    FD_SET(slot->connect_fd, &write_fds);
+    struct timeval no_wait = {0, 0};
+    int ready = select(slot->connect_fd + 1, nullptr, &write_fds, nullptr, &no_wait);
+    if (ready == 0 && millis() - slot->connect_start_ms < slot->connect_timeout_ms) {
+        return KasaPoolResult_t::kConnecting;
+    }
+
+    int sock_error = -1;
+    socklen_t sock_error_len = sizeof(sock_error);
+    if (ready > 0 && getsockopt(slot->connect_fd, SOL_SOCKET, SO_ERROR, &sock_error, &sock_error_len) == 0 && sock_error == 0) {
+        // WiFiClient expects a blocking socket; reads stay non-blocking through available()
+        fcntl(slot->connect_fd, F_SETFL, fcntl(slot->connect_fd, F_GETFL, 0) & ~O_NONBLOCK);
+        slot->client = WiFiClient(slot->connect_fd);
+        slot->connecting = false;
+        slot->open = true;
+        slot->last_used_ms = millis();
+        return KasaPoolResult_t::kMiss;
+    }
+
+#ifdef DEBUG_KASA_TRANSPORT
+    SLOG_DEBUG_PRINTF("Connect to %s failed (%s)\n", slot->ip.c_str(), ready == 0 ? "timeout" : "refused");
+#endif
+    _close(*slot);
+    _free(*slot);
+    return KasaPoolResult_t::kConnectFailed;
+}
+
+/**
+ * @brief Reopen a pooled socket after the plug dropped it during an exchange.
+ *        The socket stays acquired by the caller; the connect is only started and has
+ *        to be completed with PollConnect().
+ */
+bool KasaConnectionPool::Reconnect(WiFiClient *client, uint32_t timeout_ms)
+{
+    Slot *slot = _slotOf(client);
+    if (!slot) return false;
+    _close(*slot);
+    _count(_stats.reconnects);
+    return _startConnect(*slot, timeout_ms);
+}
+
+/**
+ * @brief Give a socket back to the pool and keep it open for the next request
+ */
+void KasaConnectionPool::Release(WiFiClient *client)
+{
+    Slot *slot = _slotOf(client);
+    if (!slot) return;
+    slot->last_used_ms = millis();
+    _free(*slot);
+}
+
+/**
+ * @brief Give a socket back to the pool after an error; the socket is closed
+ */
+void KasaConnectionPool::Invalidate(WiFiClient *client)
+{
+    Slot *slot = _slotOf(client);
+    if (!slot) return;
+    _close(*slot);
+    _free(*slot);
+}
+
+/**
+ * @brief Close sockets idle for longer than the idle timeout and sockets above the cap
+ */
+void KasaConnectionPool::EvictIdle()
+{
+    uint32_t now = millis();
+    for (size_t u = 0; u < kKasaPoolMaxSockets; u++) {
+        Slot &slot = _slots[u];
+        bool evict = false;
+        portENTER_CRITICAL(&_lock);
+        if (slot.open && !slot.in_use && (u >= _max_sockets || now - slot.last_used_ms >= _idle_timeout_ms)) {
+            slot.in_use = true;
+            evict = true;
+        }
+        portEXIT_CRITICAL(&_lock);
+        if (evict) {
+#ifdef DEBUG_KASA_TRANSPORT
+            SLOG_DEBUG_PRINTF("Closing idle pooled socket to %s\n", slot.ip.c_str());
+#endif
+            _close(slot);
+            _count(_stats.evictions);
+            _free(slot);
+        }
+    }
+}
+
+void KasaConnectionPool::CloseAll()
+{
+    for (size_t u = 0; u < kKasaPoolMaxSockets; u++) {
+        Slot &slot = _slots[u];
+        bool close = false;
+        portENTER_CRITICAL(&_lock);
+        if (slot.open && !slot.in_use) {
+            slot.in_use = true;
+            close = true;
+        }
+        portEXIT_CRITICAL(&_lock);
+        if (close) {
+            _close(slot);
+            _free(slot);
+        }
+    }
+}
+
+void KasaConnectionPool::SetMaxSockets(size_t max_sockets)
+{
+    if (max_sockets < 1) max_sockets = 1;
+    if (max_sockets > kKasaPoolMaxSockets) max_sockets = kKasaPoolMaxSockets;
+    _max_sockets = max_sockets;
+}
+
+void KasaConnectionPool::SetTimeoutLimitsMs(uint32_t min_timeout_ms, uint32_t max_timeout_ms)
+{
+    if (min_timeout_ms < 10) min_timeout_ms = 10;
+    if (max_timeout_ms < min_timeout_ms) max_timeout_ms = min_timeout_ms;
+    _min_timeout_ms = min_timeout_ms;
+    _max_timeout_ms = max_timeout_ms;
+}
+
+const size_t KasaConnectionPool::GetOpenSockets()
+{
+    size_t open_sockets = 0;
+    for (size_t u = 0; u < kKasaPoolMaxSockets; u++) {
+        if (_slots[u].open) open_sockets++;
+    }
+    return open_sockets;
+}
+
+/**
+ * @brief Encode the query and start the request; false if a request is still running
+ *        or the query does not fit into a frame
+ */
+bool KasaRequest::Start(const std::string &ip, JsonDocument &query_doc, uint32_t timeout_ms, uint8_t retries)
+{
+    if (_state != KasaRequestState_t::kIdle) return false;
+    _tx_len = kasa_encode_frame(query_doc, _tx, sizeof(_tx));
+    if (_tx_len == 0) return false;
+    return _begin(ip, timeout_ms, retries);
+}
+
+/**
+ * @brief Start the request with an already encrypted, length-prefixed frame
+ */
+bool KasaRequest::Start(const std::string &ip, const uint8_t *frame, size_t frame_len, uint32_t timeout_ms, uint8_t retries)
+{
+    if (_state != KasaRequestState_t::kIdle || frame_len == 0 || frame_len > sizeof(_tx)) return false;
+    memcpy(_tx, frame, frame_len);
+    _tx_len = frame_len;
+    return _begin(ip, timeout_ms, retries);
+}
+
+bool KasaRequest::_begin(const std::string &ip, uint32_t timeout_ms, uint8_t retries)
+{
+    _ip = ip;
+    _client = nullptr;
+    _resent = false;
+    _retries = retries;
+    _attempt = 0;
+    _streaming = false;
+    _error = 0;
+    _timeout_ms = timeout_ms;
+    _start_ms = millis();
+    _state = KasaRequestState_t::kConnecting;
+    return true;
+}
+
+void KasaRequest::_connected()
+{
+    _tx_sent = 0;
+    _state = KasaRequestState_t::kWriting;
+}
+
+/**
+ * @brief Plug dropped a pooled socket before answering: send the request once more on a fresh connection
+ */
+void KasaRequest::_resend()
+{
+#ifdef DEBUG_KASA_TRANSPORT
+    SLOG_DEBUG_PRINTF("Pooled socket to %s closed by plug - reconnecting\n", _ip.c_str());
+#endif
+    _resent = true;
+    _deadline_ms = millis() + _timeout_ms;
+    if (!g_kasa_pool.Reconnect(_client, _timeout_ms)) {
+        _fail(2);
+        return;
+    }
+    _pooled = KasaPoolResult_t::kConnecting;
+    _state = KasaRequestState_t::kConnecting;
+}
+
+/**
+ * @brief Schedule the next attempt after a timeout or a lost plug: twice the timeout (up to
+ *        the pool's ceiling), a quarter of it later. False once all retries are used up.
+ */
+bool KasaRequest::_retry()
+{
+    if (_attempt >= _retries) return false;
+    if (_client) {
+        g_kasa_pool.Invalidate(_client);
+        _client = nullptr;
+    }
+    _rx.Release();
+    _scanner.reset();
+    _streaming = false;
+    _resent = false;
+    _attempt++;
+    _timeout_ms = std::min(_timeout_ms * 2, std::max(_timeout_ms, g_kasa_pool.GetMaxTimeoutMs()));
+    _retry_ms = millis() + _timeout_ms / 4;
+#ifdef DEBUG_KASA_TRANSPORT
+    SLOG_DEBUG_PRINTF("Retry %u of %u to %s in %u ms with a %u ms timeout\n", _attempt, _retries, _ip.c_str(),
+                      static_cast<unsigned>(_timeout_ms / 4), static_cast<unsigned>(_timeout_ms));
+#endif
+    _state = KasaRequestState_t::kRetryWait;
+    return true;
+}
+
+void KasaRequest::_fail(int error)
+{
+    if (error == 2 && _retry()) return;
+    if (_client) {
+        g_kasa_pool.Invalidate(_client);
+        _client = nullptr;
+    }
+    _rx.Release();
+    _scanner.reset();
+    _error = error;
+    _state = KasaRequestState_t::kFailed;
+}
+
+/**
+ * @brief Advance the request as far as possible without blocking
+ * @return true once the request is done or failed
+ */
+bool KasaRequest::Poll()
+{
+    switch (_state) {
+    case KasaRequestState_t::kIdle:
+        return false;
+
+    case KasaRequestState_t::kRetryWait:
+        if (static_cast<int32_t>(millis() - _retry_ms) < 0) return false;
+        _state = KasaRequestState_t::kConnecting;
+        break;
+
+    case KasaRequestState_t::kConnecting:
+        if (!_client) {
+            _pooled = g_kasa_pool.Acquire(_ip, _client, _timeout_ms);
+            // All pooled sockets busy: not the plug's fault, the timeout only starts with a socket
+            if (_pooled == KasaPoolResult_t::kExhausted) return false;
+            if (_pooled == KasaPoolResult_t::kConnectFailed) {
+                _fail(2);
+                break;
+            }
+            if (_attempt == 0) _start_ms = millis();
+            _deadline_ms = millis() + _timeout_ms;
+            if (_pooled == KasaPoolResult_t::kHit) _connected();
+            // kConnecting: handshake is checked by the next Poll()
+            break;
+        }
+        switch (g_kasa_pool.PollConnect(_client)) {
+        case KasaPoolResult_t::kConnecting:
+            break;
+        case KasaPoolResult_t::kConnectFailed:
+            _client = nullptr; // already given back by the pool
+            _fail(2);
+            break;
+        default:
+            _connected();
+            break;
+        }
+        break;
+
+    case KasaRequestState_t::kWriting: {
+        size_t written = _client->write(_tx + _tx_sent, _tx_len - _tx_sent);
+        if (written == 0) {
+            if (_pooled == KasaPoolResult_t::kHit && !_resent) _resend();
+            else _fail(2);
+            break;
+        }
+        _tx_sent += written;
+        if (_tx_sent == _tx_len) {
+            _received = 0;
+            _deadline_ms = millis() + _timeout_ms;
+            _state = KasaRequestState_t::kReadingLength;
+        }
+        break;
+    }
+
+    case KasaRequestState_t::kReadingLength: {
+        int available = _client->available();
+        if (available <= 0) {
+            if (!_client->connected()) {
+                if (_pooled == KasaPoolResult_t::kHit && !_resent) _resend();
+                else _fail(2);
+            }
+            break;
+        }
+        int got = _client->read(_len_buf + _received, std::min(static_cast<size_t>(available), sizeof(_len_buf) - _received));
+        if (got < 0) {
+            _fail(5);
+            break;
+        }
+        _received += got;
+        if (_received < sizeof(_len_buf)) break;
+
+        _rx_len = (static_cast<uint32_t>(_len_buf[0]) << 24) | (static_cast<uint32_t>(_len_buf[1]) << 16) |
+                  (static_cast<uint32_t>(_len_buf[2]) << 8) | _len_buf[3];
+        if (_rx_len > kKasaMaxPayloadSize) {
+#ifdef DEBUG_KASA_TRANSPORT
+            SLOG_DEBUG_PRINTF("Response length from %s too large: %u bytes\n", _ip.c_str(), _rx_len);
+#endif
+            _fail(5);
+            break;
+        }
+        _streaming = _rx_len > _rx.Capacity();
+        if (_streaming) {
+            _scanner.reset(new KasaRelayScanner());
+            _stream_key = kKasaCipherKey;
+        } else {
+            _rx.Acquire();
+        }
+        _received = 0;
+        _state = KasaRequestState_t::kReadingBody;
+        break;
+    }
+
+    case KasaRequestState_t::kReadingBody: {
+        int available = _client->available();
+        if (available <= 0) {
+            if (!_client->connected()) _fail(2);
+            break;
+        }
+        if (_streaming) {
+            // larger than _rx: decrypt and scan what has arrived, never wait for the rest
+            uint8_t chunk[256];
+            int got = 0;
+            while (_received < _rx_len && (available = _client->available()) > 0) {
+                got = _client->read(chunk, std::min({static_cast<size_t>(available), sizeof(chunk), static_cast<size_t>(_rx_len - _received)}));
+                if (got <= 0) break;
+                _stream_key = kasa_decrypt(chunk, got, _stream_key);
+                _scanner->Feed(chunk, got);
+                _received += got;
+            }
+            if (got < 0) {
+                _fail(5);
+                break;
+            }
+            if (_received < _rx_len) break;
+            g_kasa_pool.Release(_client);
+            _client = nullptr;
+            _state = KasaRequestState_t::kDone;
+            break;
+        }
+        int got = _client->read(_rx.Data() + _received, std::min(static_cast<size_t>(available), _rx_len - _received));
+        if (got < 0) {
+            _fail(5);
+            break;
+        }
+        _received += got;
+        if (_received < _rx_len) break;
+
+        kasa_decrypt(_rx.Data(), _rx_len);
+        g_kasa_pool.Release(_client);
+        _client = nullptr;
+        _state = KasaRequestState_t::kDone;
+        break;
+    }
+
+    case KasaRequestState_t::kDone:
+    case KasaRequestState_t::kFailed:
+        return true;
+    }
+
+    // Only an attempt holding a socket can time out; waiting for a socket or a retry cannot
+    if (_client && _state != KasaRequestState_t::kDone && _state != KasaRequestState_t::kFailed &&
+        static_cast<int32_t>(millis() - _deadline_ms) >= 0) {
+#ifdef DEBUG_KASA_TRANSPORT
+        SLOG_DEBUG_PRINTF("Request to %s timed out in state %d\n", _ip.c_str(), static_cast<int>(_state));
+#endif
+        _fail(2);
+    }
+    return _state == KasaRequestState_t::kDone || _state == KasaRequestState_t::kFailed;
+}
+
+/**
+ * @brief Parse the reply of a finished request and make the request idle again
+ * @return 0 ok, 2 plug unreachable, 5 read error or response too large, 7 error reported by the plug
+ */
+int KasaRequest::Finish(JsonDocument &response_doc)
+{
+    int result = _error;
+    if (_state == KasaRequestState_t::kDone) {
+        DeserializationError error;
+        DeserializationOption::Filter filter(kasa_reply_filter().as<JsonVariantConst>());
+        if (_streaming) {
+            // only scanned while it was received
+#ifdef DEBUG_KASA_TRANSPORT
+            SLOG_DEBUG_PRINTF("Reply from %s too large for a JSON document: %u bytes\n", _ip.c_str(), _rx_len);
+#endif
+            error = DeserializationError::NoMemory;
+        } else {
+            error = deserializeJson(response_doc, _rx.Chars(), _rx_len, filter);
+        }
+        if (error) {
+#ifdef DEBUG_KASA_TRANSPORT
+            SLOG_DEBUG_PRINTF("JSON parse error from %s: %s\n", _ip.c_str(), error.c_str());
+#endif
+            result = 5;
+        } else if (response_doc["error_code"].is<int>() && response_doc["error_code"].as<int>() != 0) {
+            result = 7;
+        }
+    } else if (_state != KasaRequestState_t::kFailed) {
+        result = 2;
+    }
+    Abort();
+    return result;
+}
+
+/**
+ * @brief Scan the relay states out of the reply of a finished request without building a
+ *        JSON document and make the request idle again
+ * @return 0 ok, 2 plug unreachable, 5 read error or incomplete reply, 7 error reported by the plug
+ */
+int KasaRequest::Finish(KasaRelayScanner &scanner)
+{
+    int result = _error;
+    if (_state == KasaRequestState_t::kDone) {
+        if (_streaming) {
+            scanner = *_scanner;
+        } else {
+            scanner.Feed(_rx.Data(), _rx_len);
+        }
+        if (!scanner.IsComplete()) {
+#ifdef DEBUG_KASA_TRANSPORT
+            SLOG_DEBUG_PRINTF("Incomplete reply from %s\n", _ip.c_str());
+#endif
+            result = 5;
+        } else if (scanner.GetErrorCode() != 0) {
+            result = 7;
+        }
+    } else if (_state != KasaRequestState_t::kFailed) {
+        result = 2;
+    }
+    Abort();
+    return result;
+}
+
+/**
+ * @brief Drop the request; a socket in the middle of an exchange is closed
+ */
+void KasaRequest::Abort()
+{
+    if (_client) {
+        g_kasa_pool.Invalidate(_client);
+        _client = nullptr;
+    }
+    _rx.Release();
+    _scanner.reset();
+    _state = KasaRequestState_t::kIdle;
+}
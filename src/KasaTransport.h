@@ -0,0 +1,193 @@
+/**************************************************************************************************
+  Filename:       KasaTransport.h
+  Revised:        $Date: 2025-10-23$
+  Version:        Version: 2.2.0
+  Description:    TCP transport for Kasa Smart Plugs - persistent per-plug connection pool
+                  and non-blocking request state machine
+
+  Copyright 2024-2025. All rights reserved.
+**************************************************************************************************/
+#pragma once
+#include <Arduino.h>
+#include <WiFi.h>
+#include <ArduinoJson.h>
+#include <string>
+#include <memory>
+#include "KasaProtocol.h"
+
+// comment/uncomment to enable/disable debugging
+// #define DEBUG_KASA_TRANSPORT
+
+const uint16_t kKasaPort = 9999;                    // Kasa local protocol port (TCP and UDP)
+const size_t kKasaPoolMaxSockets = 8;               // hard upper bound of pooled sockets
+const size_t kKasaPoolDefaultSockets = 4;           // default cap of open sockets
+const uint32_t kKasaPoolDefaultIdleTimeoutMs = 30000; // close sockets not used for this time
+const uint32_t kKasaConnectTimeoutMs = 2000;        // non-blocking connect gives up after this time
+const uint32_t kKasaRequestTimeoutMs = 2000;        // KasaRequest connect and response timeout
+const uint32_t kKasaDefaultMinTimeoutMs = 200;      // floor of the RTT based timeouts
+const uint32_t kKasaDefaultMaxTimeoutMs = 2000;     // ceiling of the RTT based timeouts, used until a plug was measured
+
+/**
+ * @brief Result of KasaConnectionPool::Acquire()
+ */
+enum struct KasaPoolResult_t
+{
+    kHit,           // open socket reused
+    kMiss,          // new connection established
+    kConnectFailed, // plug not reachable; no socket handed out
+    kExhausted,     // all pooled sockets in use; no socket handed out
+    kConnecting     // non-blocking connect in progress; finish with PollConnect()
+};
+
+/**
+ * @brief Connection pool counters
+ *        hits       - request served by an already open socket
+ *        misses     - request needed a new connection
+ *        reconnects - pooled socket was closed by the plug and had to be reopened
+ *        evictions  - open sockets closed by the pool (idle or cap reached)
+ */
+struct KasaPoolStats_t
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t reconnects;
+    uint32_t evictions;
+};
+
+/**
+ * @brief Keeps TCP connections to Kasa plugs open and reuses them across requests.
+ *        Sockets are keyed by plug IP. A socket is owned exclusively by one caller
+ *        between Acquire() and Release()/Invalidate().
+ */
+class KasaConnectionPool
+{
+private:
+    struct Slot
+    {
+        std::string ip;
+        WiFiClient client;
+        uint32_t last_used_ms;
+        bool open;
+        bool in_use;
+        bool connecting;    // non-blocking connect on connect_fd in progress
+        int connect_fd;
+        uint32_t connect_start_ms;
+        uint32_t connect_timeout_ms;
+    };
+
+    Slot _slots[kKasaPoolMaxSockets];
+    size_t _max_sockets = kKasaPoolDefaultSockets;
+    uint32_t _idle_timeout_ms = kKasaPoolDefaultIdleTimeoutMs;
+    uint32_t _min_timeout_ms = kKasaDefaultMinTimeoutMs;
+    uint32_t _max_timeout_ms = kKasaDefaultMaxTimeoutMs;
+    KasaPoolStats_t _stats = {0, 0, 0, 0};
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+    Slot *_slotOf(WiFiClient *client);
+    void _close(Slot &slot);
+    bool _startConnect(Slot &slot, uint32_t timeout_ms);
+    void _free(Slot &slot);
+    void _count(uint32_t &counter);
+
+public:
+    KasaPoolResult_t Acquire(const std::string &ip, WiFiClient *&client, uint32_t timeout_ms = kKasaConnectTimeoutMs);
+    KasaPoolResult_t PollConnect(WiFiClient *client);
+    bool Reconnect(WiFiClient *client, uint32_t timeout_ms = kKasaConnectTimeoutMs);
+    void Release(WiFiClient *client);
+    void Invalidate(WiFiClient *client);
+    void EvictIdle();
+    void CloseAll();
+
+    void SetMaxSockets(size_t max_sockets);
+    const size_t GetMaxSockets() { return _max_sockets; };
+    void SetIdleTimeoutMs(uint32_t idle_timeout_ms) { _idle_timeout_ms = idle_timeout_ms; };
+    const uint32_t GetIdleTimeoutMs() { return _idle_timeout_ms; };
+    void SetTimeoutLimitsMs(uint32_t min_timeout_ms, uint32_t max_timeout_ms);
+    const uint32_t GetMinTimeoutMs() { return _min_timeout_ms; };
+    const uint32_t GetMaxTimeoutMs() { return _max_timeout_ms; };
+    const size_t GetOpenSockets();
+    const KasaPoolStats_t &GetStats() { return _stats; };
+};
+
+extern KasaConnectionPool g_kasa_pool;
+
+/**
+ * @brief State of a KasaRequest
+ */
+enum struct KasaRequestState_t
+{
+    kIdle,
+    kRetryWait,     // attempt timed out or lost the plug, next attempt not due yet
+    kConnecting,    // waiting for a pooled socket or for the TCP handshake
+    kWriting,       // sending the request frame
+    kReadingLength, // waiting for the 4 byte length prefix
+    kReadingBody,   // receiving the encrypted payload
+    kDone,
+    kFailed
+};
+
+/**
+ * @brief One query to a Kasa plug as a non-blocking state machine. Start() encodes the
+ *        request, Poll() advances it without ever waiting on the network and returns true
+ *        once the request is done or failed, Finish() parses the reply and makes the
+ *        request idle again. Sockets come from g_kasa_pool. Replies larger than the receive
+ *        buffer are decrypted and scanned for the relay states chunk by chunk by Poll() as the
+ *        bytes arrive; they can only be finished with a KasaRelayScanner. An attempt that
+ *        times out or loses the plug is repeated up to retries times, each time with twice the
+ *        timeout (up to the pool's ceiling) and after a quarter of it.
+ */
+class KasaRequest
+{
+private:
+    std::string _ip;
+    KasaRequestState_t _state = KasaRequestState_t::kIdle;
+    WiFiClient *_client = nullptr;
+    KasaPoolResult_t _pooled = KasaPoolResult_t::kMiss;
+    bool _resent = false;
+    uint8_t _retries = 0;
+    uint8_t _attempt = 0;
+    int _error = 0;
+
+    uint8_t _tx[kKasaTxFrameSize];
+    size_t _tx_len = 0;
+    size_t _tx_sent = 0;
+    KasaRxBuffer _rx{false};
+    uint8_t _len_buf[kKasaFrameHeaderSize];
+    uint32_t _rx_len = 0;
+    size_t _received = 0;
+    bool _streaming = false; // reply larger than _rx: scanned by Poll() while it is received
+    std::unique_ptr<KasaRelayScanner> _scanner;
+    uint8_t _stream_key = kKasaCipherKey;
+
+    uint32_t _timeout_ms = kKasaRequestTimeoutMs;
+    uint32_t _start_ms = 0;
+    uint32_t _deadline_ms = 0;
+    uint32_t _retry_ms = 0;
+
+    bool _begin(const std::string &ip, uint32_t timeout_ms, uint8_t retries);
+    void _connected();
+    void _resend();
+    bool _retry();
+    void _fail(int error);
+
+public:
+    KasaRequest() {};
+    ~KasaRequest() { Abort(); };
+    KasaRequest(const KasaRequest &) = delete;
+    KasaRequest &operator=(const KasaRequest &) = delete;
+
+    bool Start(const std::string &ip, JsonDocument &query_doc, uint32_t timeout_ms = kKasaRequestTimeoutMs, uint8_t retries = 0);
+    bool Start(const std::string &ip, const uint8_t *frame, size_t frame_len, uint32_t timeout_ms = kKasaRequestTimeoutMs, uint8_t retries = 0);
+    bool Poll();
+    int Finish(JsonDocument &response_doc);
+    int Finish(KasaRelayScanner &scanner);
+    void Abort();
+
+    const KasaRequestState_t GetState() { return _state; };
+    const bool IsIdle() { return _state == KasaRequestState_t::kIdle; };
+    const bool IsRetryWait() { return _state == KasaRequestState_t::kRetryWait; };
+    const uint32_t GetElapsedMs() { return millis() - _start_ms; };
+    const bool WasResent() { return _resent || _attempt > 0; };
+    const bool IsStreamed() { return _streaming; };
+    const std::string &GetIp() { return _ip; };
+};
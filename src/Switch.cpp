@@ -7,189 +7,275 @@
   Copyright 2024-2025. All rights reserved.
 **************************************************************************************************/
 #include "Switch.h"
+#include "KasaProtocol.h"
+#include "KasaTransport.h"
 #include <WiFi.h>
 #include <WiFiUdp.h>
 #include <ArduinoJson.h>
 #include <algorithm>
+#include <cmath>
 #include <SLog.h>
 #include <Preferences.h>
-#include <map>
 
-// Maximum number of switches selectable during discovery UI; exposed count will match enabled
-const size_t kMaxKasaSwitches = 15; // hard upper bound for allocation and UI
-
-std::string encrypt(const std::string& input) {
-    std::string result;
-    uint8_t key = 171;
-    for (char c : input) {
-        uint8_t a = key ^ static_cast<uint8_t>(c);
-        key = a;
-        result += static_cast<char>(a);
+// Poll scheduler
+const uint32_t kKasaDefaultPollIntervalMs = 2000; // base interval of a switch unless configured
+const uint32_t kKasaMinPollIntervalMs = 250;
+const uint32_t kKasaMaxPollIntervalMs = 60000;
+const uint32_t kKasaFastPollIntervalMs = 250;     // interval shortly after a write ...
+const uint32_t kKasaFastPollWindowMs = 5000;      // ... for this time
+const uint8_t kKasaMaxPollBackoff = 2;            // unchanged devices back off up to base << 2
+
+// UDP poll mode
+const uint32_t kKasaUdpPollTimeoutMs = 500;      // no UDP reply within this time: poll over TCP
+
+// Circuit breaker
+const uint8_t kKasaBreakerOpenFailures = 3;       // consecutive failures until a plug is no longer polled
+const uint32_t kKasaBreakerMinDelayMs = 5000;     // first probe of an open plug after this time ...
+const uint32_t kKasaBreakerMaxDelayMs = 300000;   // ... doubling with every failed probe up to this
+const uint32_t kKasaResolveMinIntervalMs = 5000;  // re-resolution broadcasts per device at most this often
+
+// Retries of a timed out request (none while the breaker is open)
+const uint8_t kKasaPollRetries = 1;
+const uint8_t kKasaWriteRetries = 2;
+
+// Kasa I/O task
+const uint32_t kKasaIoTaskStackSize = 8192;
+const UBaseType_t kKasaIoTaskPriority = 2;
+const BaseType_t kKasaIoTaskCore = 0;
+const UBaseType_t kKasaIoQueueLength = 16;
+const uint32_t kKasaIoTickMs = 10; // poll tick while no command is queued
+const uint32_t kKasaIoQueueTimeoutMs = 1000; // a full command queue fails the call after this time
+const uint32_t kKasaIoWaitTimeoutMs = 10000; // waited for commands fail after this time plus the inrush delays
+const uint32_t kKasaMaxInrushDelayMs = 5000; // upper limit of the spacing of relay changes
+const uint32_t kKasaVerifyDeadlineMs = 3000; // saved plugs not answering by then are reported unreachable
+
+// Discovery
+const uint32_t kKasaDiscoveryDurationMs = 5900; // scan time, catches stragglers of the last broadcast
+const uint32_t kKasaDiscoveryBroadcastMs = 900; // get_sysinfo broadcast interval during a scan
+
+/**
+ * Short field name of discovered switch i on the setup page: name with special characters
+ * replaced by underscores, max. 20 characters, without trailing underscores
+ */
+static void selectionKey(const KasaPlug& plug, size_t i, char* switch_key, size_t size) {
+    snprintf(switch_key, size, "%s", plug.name.c_str());
+    
+    // Replace spaces and special characters with underscores
+    for (char* p = switch_key; *p; ++p) {
+        if (*p == ' ' || *p == '-' || *p == '(' || *p == ')' || *p == '.') {
+            *p = '_';
+        }
     }
-    return result;
-}
-
-std::string decrypt(const std::string& input) {
-    std::string result;
-    uint8_t key = 171;
-    for (char c : input) {
-        uint8_t a = key ^ static_cast<uint8_t>(c);
-        key = static_cast<uint8_t>(c);
-        result += static_cast<char>(a);
+    
+    // Truncate very long names to prevent wrapping
+    if (strlen(switch_key) > 20) {
+        switch_key[20] = '\0';
+    }
+    
+    // Remove trailing underscores to prevent JavaScript parsing issues
+    size_t len = strlen(switch_key);
+    while (len > 0 && switch_key[len - 1] == '_') {
+        switch_key[len - 1] = '\0';
+        len--;
+    }
+    
+    // Ensure we don't have an empty key
+    if (strlen(switch_key) == 0) {
+        snprintf(switch_key, size, "sw%zu", i);
     }
-    return result;
 }
 
-int send_query(const std::string& ip, JsonDocument& query_doc, JsonDocument& response_doc, int retries = 3) {
-    String payload;
-    serializeJson(query_doc, payload);
-    std::string enc = encrypt(payload.c_str());
-
-    uint32_t len = htonl(static_cast<uint32_t>(enc.size()));
-    std::string message(reinterpret_cast<char*>(&len), 4);
-    message += enc;
-
-    for (int attempt = 0; attempt < retries; ++attempt) {
-        WiFiClient client;
-        client.setTimeout(2000);
-        if (!client.connect(ip.c_str(), 9999)) {
-#ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("Attempt %d: Failed to connect to %s:9999\n", attempt + 1, ip.c_str());
-#endif
-            if (attempt < retries - 1) delay(500);
-            continue;
-        }
-
-        client.write(reinterpret_cast<const uint8_t*>(message.c_str()), message.size());
-
-        uint8_t buf[4];
-        int read_bytes = client.readBytes(buf, 4);
-        if (read_bytes != 4) {
-#ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("Attempt %d: Failed to read length from %s: got %d bytes\n", attempt + 1, ip.c_str(), read_bytes);
-#endif
-            client.stop();
-            if (attempt < retries - 1) delay(500);
-            continue;
-        }
+/**
+ * get_sysinfo for a whole device, encrypted once. Polls send it as TCP frame; without the
+ * kKasaFrameHeaderSize length prefix it is the datagram for UDP polls and broadcasts.
+ */
+static const std::string& device_sysinfo_frame() {
+    static const std::string frame = [] {
+        JsonDocument query_doc;
+        query_doc["system"].to<JsonObject>()["get_sysinfo"] = JsonObject();
+        uint8_t buf[64];
+        size_t len = kasa_encode_frame(query_doc, buf, sizeof(buf));
+        return std::string(reinterpret_cast<char*>(buf), len);
+    }();
+    return frame;
+}
 
-        uint32_t rlen = ntohl(*reinterpret_cast<uint32_t*>(buf));
-        if (rlen > 4096) {
+KasaPlug::KasaPlug(const std::string& addr, const std::string& n, const std::string& m, bool child, int index, const std::string& did)
+    : address(addr), name(n), model(m), is_child(child), child_index(index), device_id(did), state(false), state_str("off"), enabled(true), rtt_ms(0), updated_ms(0), poll_interval_ms(kKasaDefaultPollIntervalMs), udp_poll(false),
+      health(KasaHealth_t::kHealthy), failures(0), last_error(0), breaker_delay_ms(kKasaBreakerMinDelayMs), srtt_ms(0), rttvar_ms(0),
+      unverified_state(-1), unverified_since_ms(0), stale(false), pending(false) {
+    buildFrames();
+    buildKeys();
 #ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("Attempt %d: Response length from %s too large: %u bytes\n", attempt + 1, ip.c_str(), rlen);
+    SLOG_DEBUG_PRINTF("Created KasaPlug: %s, is_child: %d, child_index: %d, device_id: %s, enabled: %d\n",
+                      name.c_str(), is_child, child_index, device_id.c_str(), enabled);
 #endif
-            client.stop();
-            return 5;
-        }
+}
 
-        std::vector<uint8_t> renc_vec(rlen);
-        size_t received = 0;
-        unsigned long start = millis();
-        while (received < rlen && millis() - start < 2000) {
-            int got = client.read(&renc_vec[received], rlen - received);
-            if (got < 0) {
-#ifdef DEBUG_SWITCH
-                SLOG_DEBUG_PRINTF("Attempt %d: Read error from %s: %d\n", attempt + 1, ip.c_str(), got);
-#endif
-                client.stop();
-                return 5;
-            }
-            received += got;
+/**
+ * The requests of a plug never change: encrypt them once so a poll or write only copies a buffer
+ */
+void KasaPlug::buildFrames() {
+    uint8_t buf[kKasaTxFrameSize];
+    std::string full_child_id = childId();
+    auto build = [&](int relay_state, bool read_back) {
+        JsonDocument query_doc;
+        JsonObject query = query_doc.to<JsonObject>();
+        JsonObject system = query["system"].to<JsonObject>();
+        if (relay_state >= 0) system["set_relay_state"].to<JsonObject>()["state"] = relay_state;
+        if (read_back) system["get_sysinfo"] = JsonObject(); // executed after set_relay_state
+        if (is_child && child_index >= 0) {
+            query["context"].to<JsonObject>()["child_ids"].to<JsonArray>().add(full_child_id.c_str());
         }
+        size_t len = kasa_encode_frame(query_doc, buf, sizeof(buf));
+        return std::string(reinterpret_cast<char*>(buf), len);
+    };
+    on_frame = build(1, true);
+    off_frame = build(0, true);
+    set_on_frame = build(1, false);
+    set_off_frame = build(0, false);
+}
 
-        if (received != rlen) {
-#ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("Attempt %d: Incomplete read from %s: got %zu of %u bytes\n", attempt + 1, ip.c_str(), received, rlen);
-#endif
-            client.stop();
-            if (attempt < retries - 1) delay(500);
-            continue;
-        }
+std::string KasaPlug::childId() const {
+    char index_str[8];
+    snprintf(index_str, sizeof(index_str), "%02d", child_index);
+    return device_id + index_str;
+}
 
-        std::string renc(reinterpret_cast<char*>(renc_vec.data()), rlen);
-        std::string rplain = decrypt(renc);
+/**
+ * Same outlet as seen by a discovery: deviceId plus child index. If either side has no
+ * deviceId (plugs saved without one) address plus child index decide.
+ */
+bool KasaPlug::sameOutlet(const std::string& did, const std::string& addr, bool child, int index) const {
+    if (is_child != child || child_index != index) return false;
+    if (!device_id.empty() && !did.empty()) return device_id == did;
+    return address == addr;
+}
 
-        client.stop();
+/**
+ * Take address, alias, model and deviceId over from a later discovery of the same outlet;
+ * relay state, health and RTT are kept. Frames are rebuilt if the deviceId changed.
+ * @return true if anything changed
+ */
+bool KasaPlug::update(const KasaPlug& seen) {
+    stale = false;
+    bool new_id = device_id != seen.device_id;
+    if (!new_id && address == seen.address && name == seen.name && model == seen.model) return false;
+    address = seen.address;
+    name = seen.name;
+    model = seen.model;
+    device_id = seen.device_id;
+    if (new_id) buildFrames();
+    buildKeys();
+    return true;
+}
 
-        DeserializationError error = deserializeJson(response_doc, rplain);
-        if (error) {
-#ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("JSON parse error from %s: %s\nRaw response: %s\n", ip.c_str(), error.c_str(), rplain.c_str());
-#endif
-            if (attempt < retries - 1) delay(500);
-            continue;
-        }
+/**
+ * The plug got a new IP (DHCP); frames do not contain the address
+ */
+void KasaPlug::moveTo(const std::string& addr) {
+    address = addr;
+    buildKeys();
+}
 
-        if (response_doc["error_code"].is<int>() && response_doc["error_code"].as<int>() != 0) {
-#ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("Kasa error from %s: error_code %d\n", ip.c_str(), response_doc["error_code"].as<int>());
-#endif
-            return 7;
-        }
+/**
+ * FNV-1a over id and child index; id is the deviceId, or the address of plugs without one
+ */
+uint32_t KasaPlug::identityOf(const std::string& id, int index) {
+    uint32_t hash = 2166136261u;
+    for (char c : id) hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    for (int shift = 0; shift < 32; shift += 8) hash = (hash ^ static_cast<uint8_t>(index >> shift)) * 16777619u;
+    return hash;
+}
 
-        return 0;
+/**
+ * Lookup keys derived from address, alias and deviceId, computed once instead of per request
+ */
+void KasaPlug::buildKeys() {
+    identity = identityOf(device_id.empty() ? address : device_id, child_index);
+
+    // Setup page key: address + name + optional child info with special characters replaced
+    // by underscores (dots too, to match what gets sent in form data), no trailing underscores
+    stable_key = address + "_" + name;
+    if (is_child) stable_key += "_child_" + std::to_string(child_index);
+    for (char& c : stable_key) {
+        if (c == ' ' || c == '-' || c == '(' || c == ')' || c == '.') c = '_';
     }
-
-    return 2;
+    while (!stable_key.empty() && stable_key.back() == '_') stable_key.pop_back();
+    if (stable_key.empty()) stable_key = "default_key";
 }
 
-KasaPlug::KasaPlug(const std::string& addr, const std::string& n, const std::string& m, bool child, int index, const std::string& did)
-    : address(addr), name(n), model(m), is_child(child), child_index(index), device_id(did), state(false), state_str("off"), enabled(true) {
-#ifdef DEBUG_SWITCH
-    SLOG_DEBUG_PRINTF("Created KasaPlug: %s, is_child: %d, child_index: %d, device_id: %s, enabled: %d\n",
-                      name.c_str(), is_child, child_index, device_id.c_str(), enabled);
-#endif
+void KasaPlugIndex::Rebuild(const std::vector<KasaPlug>& plugs) {
+    _plugs = &plugs;
+    _by_identity.clear();
+    _by_key.clear();
+    for (size_t u = 0; u < plugs.size(); u++) Add(plugs, u);
 }
 
-bool KasaPlug::check(int retries) {
-    JsonDocument query_doc;
-    JsonObject query = query_doc.to<JsonObject>();
-    query["system"].to<JsonObject>()["get_sysinfo"] = JsonObject();
+/**
+ * Index plug u, appended to plugs after the last Rebuild()/Add(). Plugs with a deviceId are
+ * also indexed by address so lookups without deviceId still find them.
+ */
+void KasaPlugIndex::Add(const std::vector<KasaPlug>& plugs, size_t u) {
+    _plugs = &plugs;
+    const KasaPlug& plug = plugs[u];
+    _by_identity.emplace(plug.identity, u);
+    if (!plug.device_id.empty()) _by_identity.emplace(KasaPlug::identityOf(plug.address, plug.child_index), u);
+    _by_key.emplace(plug.stable_key, u);
+}
 
-    std::string full_child_id;
-    if (is_child && child_index >= 0) {
-        std::string index_str = child_index < 10 ? "0" + std::to_string(child_index) : std::to_string(child_index);
-        full_child_id = device_id + index_str;
-        JsonObject context = query["context"].to<JsonObject>();
-        JsonArray child_ids = context["child_ids"].to<JsonArray>();
-        child_ids.add(full_child_id.c_str());
-#ifdef DEBUG_SWITCH
-        SLOG_DEBUG_PRINTF("Querying child plug %s with child_index %d, full_child_id %s\n",
-                          name.c_str(), child_index, full_child_id.c_str());
-#endif
+int KasaPlugIndex::_find(uint32_t identity, const std::string& device_id, const std::string& address, bool is_child, int child_index) const {
+    auto range = _by_identity.equal_range(identity);
+    for (auto it = range.first; it != range.second; ++it) {
+        if ((*_plugs)[it->second].sameOutlet(device_id, address, is_child, child_index)) return static_cast<int>(it->second);
     }
+    return -1;
+}
 
-    JsonDocument resp_doc;
-    int result = send_query(address, query_doc, resp_doc, retries);
-    if (result != 0) {
-#ifdef DEBUG_SWITCH
-        SLOG_DEBUG_PRINTF("Check failed for %s: error code %d\n", name.c_str(), result);
-#endif
-        return false;
-    }
+/**
+ * @return position of the outlet in the indexed list, -1 if not found
+ */
+int KasaPlugIndex::Find(const std::string& device_id, const std::string& address, bool is_child, int child_index) const {
+    if (!_plugs) return -1;
+    int u = -1;
+    if (!device_id.empty()) u = _find(KasaPlug::identityOf(device_id, child_index), device_id, address, is_child, child_index);
+    if (u < 0) u = _find(KasaPlug::identityOf(address, child_index), device_id, address, is_child, child_index);
+    return u;
+}
 
-    JsonObject sysinfo = resp_doc["system"]["get_sysinfo"];
-    if (sysinfo.isNull()) {
-#ifdef DEBUG_SWITCH
-        SLOG_DEBUG_PRINTF("No sysinfo in response for %s\n", name.c_str());
-#endif
-        return false;
-    }
+int KasaPlugIndex::FindKey(const char* stable_key) const {
+    auto it = _by_key.find(stable_key);
+    return it == _by_key.end() ? -1 : static_cast<int>(it->second);
+}
 
+/**
+ * Update state from a get_sysinfo reply of this plug's device. Child plugs pick their
+ * entry from the children array, so one reply serves all outlets of a power strip.
+ */
+bool KasaPlug::applySysinfo(JsonObject sysinfo) {
     if (is_child && child_index >= 0) {
         JsonArray children = sysinfo["children"];
-        if (children.isNull() || child_index >= (int)children.size()) {
+        if (children.isNull()) {
 #ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("No children array or invalid child_index %d for %s\n", child_index, name.c_str());
+            SLOG_DEBUG_PRINTF("No children array for %s\n", name.c_str());
 #endif
             return false;
         }
-        JsonObject child = children[child_index];
-        std::string child_id_from_response = child["id"].as<std::string>();
-        if (child_id_from_response != full_child_id) {
+        std::string full_child_id = childId();
+        JsonObject child;
+        if (child_index < (int)children.size() && full_child_id == (children[child_index]["id"] | "")) {
+            child = children[child_index];
+        } else {
+            for (JsonObject c : children) {
+                if (full_child_id == (c["id"] | "")) {
+                    child = c;
+                    break;
+                }
+            }
+        }
+        if (child.isNull()) {
 #ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("Child ID mismatch for %s: expected %s, got %s\n",
-                              name.c_str(), full_child_id.c_str(), child_id_from_response.c_str());
+            SLOG_DEBUG_PRINTF("Child %s (index %d) not found in reply for %s\n", full_child_id.c_str(), child_index, name.c_str());
 #endif
             return false;
         }
@@ -198,34 +284,155 @@ bool KasaPlug::check(int retries) {
         state = sysinfo["relay_state"].as<int>() == 1;
     }
     state_str = state ? "on" : "off";
+    updated_ms = millis();
     return true;
 }
 
-bool KasaPlug::turn(bool on_off) {
-    int st = on_off ? 1 : 0;
-    JsonDocument query_doc;
-    JsonObject query = query_doc.to<JsonObject>();
-    JsonObject system = query["system"].to<JsonObject>();
-    JsonObject set_relay = system["set_relay_state"].to<JsonObject>();
-    set_relay["state"] = st;
+/**
+ * Circuit breaker: feed the result of every request to the plug (0 ok, else error code).
+ * kKasaBreakerOpenFailures consecutive failures open the breaker; a failed probe doubles the
+ * probe delay, any success closes the breaker again.
+ */
+void KasaPlug::recordResult(int error) {
+    last_error = error;
+    if (error == 0) {
+        pending = false;
+        if (health != KasaHealth_t::kHealthy) {
+            SLOG_INFO_PRINTF("%s at %s recovered (%s -> healthy)\n", name.c_str(), address.c_str(), healthStr());
+        }
+        health = KasaHealth_t::kHealthy;
+        failures = 0;
+        breaker_delay_ms = kKasaBreakerMinDelayMs;
+        return;
+    }
 
+    if (failures < 255) failures++;
+    switch (health) {
+    case KasaHealth_t::kHealthy:
+    case KasaHealth_t::kSuspect:
+        if (failures >= kKasaBreakerOpenFailures) {
+            health = KasaHealth_t::kOpen;
+            breaker_delay_ms = kKasaBreakerMinDelayMs;
+            SLOG_NOTICE_PRINTF("%s at %s unreachable (error %d, %u failures) - breaker open, next probe in %u s\n",
+                               name.c_str(), address.c_str(), error, failures, static_cast<unsigned>(breaker_delay_ms / 1000));
+        } else {
+            if (health == KasaHealth_t::kHealthy) {
+                SLOG_NOTICE_PRINTF("%s at %s suspect (error %d)\n", name.c_str(), address.c_str(), error);
+            }
+            health = KasaHealth_t::kSuspect;
+        }
+        break;
+    case KasaHealth_t::kOpen:
+    case KasaHealth_t::kHalfOpen:
+        health = KasaHealth_t::kOpen;
+        breaker_delay_ms = std::min(breaker_delay_ms * 2, kKasaBreakerMaxDelayMs);
+#ifdef DEBUG_SWITCH
+        SLOG_DEBUG_PRINTF("Probe of %s failed (error %d) - next probe in %u s\n", name.c_str(), error, static_cast<unsigned>(breaker_delay_ms / 1000));
+#endif
+        break;
+    }
+}
+
+/**
+ * Round trip time estimator as for the TCP retransmission timer (RFC 6298): srtt and rttvar are
+ * smoothed with gains 1/8 and 1/4. Only exchanges that succeeded at the first attempt are sampled.
+ */
+void KasaPlug::sampleRtt(uint32_t sample_ms) {
+    if (srtt_ms == 0) {
+        srtt_ms = std::max(sample_ms, static_cast<uint32_t>(1));
+        rttvar_ms = sample_ms / 2;
+        return;
+    }
+    uint32_t delta_ms = sample_ms > srtt_ms ? sample_ms - srtt_ms : srtt_ms - sample_ms;
+    rttvar_ms = (3 * rttvar_ms + delta_ms) / 4;
+    srtt_ms = std::max((7 * srtt_ms + sample_ms) / 8, static_cast<uint32_t>(1));
+}
+
+/**
+ * Connect / read timeout: srtt + 4 * rttvar (at least one I/O tick), within the configured
+ * limits; the ceiling until the plug was measured
+ */
+uint32_t KasaPlug::timeoutMs() const {
+    uint32_t max_ms = g_kasa_pool.GetMaxTimeoutMs();
+    if (srtt_ms == 0) return max_ms;
+    uint32_t rto_ms = srtt_ms + std::max(kKasaIoTickMs, 4 * rttvar_ms);
+    return std::max(g_kasa_pool.GetMinTimeoutMs(), std::min(rto_ms, max_ms));
+}
+
+/**
+ * An open plug is due for a probe request
+ */
+void KasaPlug::probe() {
+    if (health == KasaHealth_t::kOpen) health = KasaHealth_t::kHalfOpen;
+}
+
+const char* KasaPlug::healthStr() const {
+    switch (health) {
+    case KasaHealth_t::kHealthy: return "healthy";
+    case KasaHealth_t::kSuspect: return "suspect";
+    case KasaHealth_t::kOpen: return "open";
+    case KasaHealth_t::kHalfOpen: return "half-open";
+    }
+    return "unknown";
+}
+
+/**
+ * Same as applySysinfo() for a reply that was only scanned for the relay states (polls)
+ */
+bool KasaPlug::applyRelayStates(KasaRelayScanner &scanner) {
     if (is_child && child_index >= 0) {
-        std::string index_str = child_index < 10 ? "0" + std::to_string(child_index) : std::to_string(child_index);
-        std::string full_child_id = device_id + index_str;
-        JsonObject context = query["context"].to<JsonObject>();
-        JsonArray child_ids = context["child_ids"].to<JsonArray>();
-        child_ids.add(full_child_id.c_str());
+        std::string full_child_id = childId();
+        int child_state = -1;
+        size_t count = scanner.GetChildCount();
+        if (static_cast<size_t>(child_index) < count && full_child_id == scanner.GetChild(child_index).id) {
+            child_state = scanner.GetChild(child_index).state;
+        } else {
+            for (size_t u = 0; u < count; u++) {
+                if (full_child_id == scanner.GetChild(u).id) {
+                    child_state = scanner.GetChild(u).state;
+                    break;
+                }
+            }
+        }
+        if (child_state < 0) {
 #ifdef DEBUG_SWITCH
-        SLOG_DEBUG_PRINTF("Turning %s %s with child_index %d, full_child_id %s\n",
-                          name.c_str(), on_off ? "ON" : "OFF", child_index, full_child_id.c_str());
+            SLOG_DEBUG_PRINTF("Child %s (index %d) not found in reply for %s\n", full_child_id.c_str(), child_index, name.c_str());
 #endif
+            return false;
+        }
+        state = child_state == 1;
+    } else {
+        if (scanner.GetRelayState() < 0) return false;
+        state = scanner.GetRelayState() == 1;
+    }
+    state_str = state ? "on" : "off";
+    updated_ms = millis();
+    return true;
+}
+
+/**
+ * set_relay_state (+ get_sysinfo with read_back) for outlets of one device going to the same
+ * state. A single outlet or plug uses its cached frame; several outlets of a strip share one
+ * set_relay_state with all their child ids.
+ */
+std::string KasaPlug::relayFrame(const std::vector<const KasaPlug*> &outlets, bool on_off, bool read_back) {
+    if (outlets.size() == 1) {
+        if (read_back) return on_off ? outlets[0]->on_frame : outlets[0]->off_frame;
+        return on_off ? outlets[0]->set_on_frame : outlets[0]->set_off_frame;
     }
 
-    JsonDocument resp_doc;
-    if (send_query(address, query_doc, resp_doc) != 0) {
-        return false;
+    JsonDocument query_doc;
+    JsonObject query = query_doc.to<JsonObject>();
+    JsonObject system = query["system"].to<JsonObject>();
+    system["set_relay_state"].to<JsonObject>()["state"] = on_off ? 1 : 0;
+    if (read_back) system["get_sysinfo"] = JsonObject(); // executed after set_relay_state
+    JsonArray child_ids = query["context"].to<JsonObject>()["child_ids"].to<JsonArray>();
+    for (const KasaPlug* outlet : outlets) {
+        child_ids.add(outlet->childId());
     }
-    return check();
+    uint8_t buf[kKasaTxFrameSize];
+    size_t len = kasa_encode_frame(query_doc, buf, sizeof(buf));
+    return std::string(reinterpret_cast<char*>(buf), len);
 }
 
 Switch::Switch() : AlpacaSwitch(kMaxKasaSwitches) {
@@ -243,10 +450,15 @@ Switch::Switch() : AlpacaSwitch(kMaxKasaSwitches) {
         InitSwitchInitBySetup(u, false);
         SetSwitchValue(u, 0.0);
     }
+    _broadcast_interval_ms = kKasaDefaultPollIntervalMs;
 }
 
 void Switch::Begin() {
     SLOG_INFO_PRINTF("Switch::Begin() starting...\n");
+    _switches_mutex = xSemaphoreCreateMutex();
+    _prefs_mutex = xSemaphoreCreateMutex();
+    _io_queue = xQueueCreate(kKasaIoQueueLength, sizeof(KasaIoCommand_t));
+    _io_done = xSemaphoreCreateBinary();
     
     // Load saved switches from persistent storage first
     SLOG_INFO_PRINTF("Loading settings from persistent storage...\n");
@@ -260,276 +472,1105 @@ void Switch::Begin() {
     
     SLOG_INFO_PRINTF("Calling AlpacaSwitch::Begin()...\n");
     AlpacaSwitch::Begin();
-    
-    // TODO: Custom HTTP endpoint disabled due to crash - will use alternative approach
-    // this->createCallBack(LHF(_handleDiscoverKasa), HTTP_POST, "discover_kasa");
-    
+
+    // Bulk switching and batch read, see _putAction()
+    _addAction("SetMany");
+    _addAction("AllOn");
+    _addAction("AllOff");
+    _addAction("GetAllSwitches");
+
     // MaxSwitch already set to enabled count
 
-#ifdef DEBUG_SWITCH
-    DebugSwitchDevice(kMaxKasaSwitches);
-#endif
-    
-    SLOG_INFO_PRINTF("Switch::Begin() completed successfully\n");
+#ifdef DEBUG_SWITCH
+    DebugSwitchDevice(kMaxKasaSwitches);
+#endif
+
+    // From now on all plug I/O runs in the Kasa I/O task
+    if (xTaskCreatePinnedToCore(_ioTask, "kasa_io", kKasaIoTaskStackSize, this, kKasaIoTaskPriority, &_io_task, kKasaIoTaskCore) != pdPASS) {
+        _io_task = nullptr;
+        SLOG_ERROR_PRINTF("Failed to start Kasa I/O task\n");
+    }
+    
+    SLOG_INFO_PRINTF("Switch::Begin() completed successfully\n");
+}
+
+/**
+ * @brief Kasa I/O task: executes queued commands and advances the device polls
+ */
+void Switch::_ioTask(void *param) {
+    Switch *self = static_cast<Switch *>(param);
+    KasaIoCommand_t cmd;
+    for (;;) {
+        // Waiting for a command doubles as the poll tick
+        if (xQueueReceive(self->_io_queue, &cmd, pdMS_TO_TICKS(kKasaIoTickMs)) == pdTRUE) {
+            // Take everything queued meanwhile so writes to the same plug can be coalesced
+            do {
+                if (cmd.type == KasaIoCommandType_t::kSetRelay) {
+                    self->_queueWrite(cmd);
+                    continue;
+                }
+                bool result = self->_executeIoCommand(cmd);
+                if (cmd.ticket != 0) {
+                    self->_lockSwitches();
+                    self->_ioCommandDone(cmd.ticket, result);
+                    self->_unlockSwitches();
+                }
+            } while (xQueueReceive(self->_io_queue, &cmd, 0) == pdTRUE);
+        }
+        // Close pooled sockets nobody used for a while
+        g_kasa_pool.EvictIdle();
+        self->_writeDevices();
+        self->_pollDevices();
+        self->_advanceDiscovery();
+    }
+}
+
+/**
+ * @brief Hand a command to the Kasa I/O task and wait for its result
+ */
+bool Switch::_runIoCommand(const KasaIoCommand_t &cmd) {
+    return _runIoCommands(&cmd, 1);
+}
+
+/**
+ * @brief Hand commands to the Kasa I/O task and wait until all of them are done, at most
+ *        kKasaIoWaitTimeoutMs plus the inrush delays. Before the task is started (Begin()) the
+ *        commands run directly. Each call gets its own ticket, so completions of a call that
+ *        timed out are ignored instead of being counted for the next one.
+ * @return true if every command succeeded in time
+ */
+bool Switch::_runIoCommands(const KasaIoCommand_t *cmds, size_t count) {
+    if (count == 0) return true;
+    _lockSwitches();
+    xSemaphoreTake(_io_done, 0); // left over by a call that timed out just as it completed
+    if (++_io_next_ticket == 0) ++_io_next_ticket;
+    uint32_t ticket = _io_next_ticket;
+    _io_ticket = ticket;
+    _io_waiting = count;
+    _io_ok = true;
+    _unlockSwitches();
+
+    size_t queued = 0;
+    for (; queued < count; queued++) {
+        KasaIoCommand_t waited = cmds[queued];
+        waited.ticket = ticket;
+        if (_io_task) {
+            if (xQueueSend(_io_queue, &waited, pdMS_TO_TICKS(kKasaIoQueueTimeoutMs)) != pdTRUE) break;
+        } else if (waited.type == KasaIoCommandType_t::kSetRelay) {
+            _queueWrite(waited);
+        } else {
+            bool result = _executeIoCommand(waited);
+            _lockSwitches();
+            _ioCommandDone(ticket, result);
+            _unlockSwitches();
+        }
+    }
+
+    uint32_t timeout_ms = kKasaIoWaitTimeoutMs + count * _inrush_delay_ms;
+    bool done = false;
+    if (queued < count) {
+        SLOG_ERROR_PRINTF("Kasa I/O queue full: %u of %u command(s) not queued\n", static_cast<unsigned>(count - queued), static_cast<unsigned>(count));
+    } else if (!_io_task) {
+        // No I/O task: drive the queued writes to completion here
+        uint32_t start_ms = millis();
+        while (!(done = xSemaphoreTake(_io_done, 0) == pdTRUE) && millis() - start_ms < timeout_ms) {
+            _writeDevices();
+            _pollDevices();
+            delay(kKasaIoTickMs);
+        }
+    } else {
+        done = xSemaphoreTake(_io_done, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+    }
+
+    _lockSwitches();
+    bool result = done && _io_ok;
+    if (!done && queued == count) {
+        SLOG_ERROR_PRINTF("Kasa I/O: %u of %u command(s) not done within %u ms\n", static_cast<unsigned>(_io_waiting), static_cast<unsigned>(count), static_cast<unsigned>(timeout_ms));
+    }
+    _io_ticket = 0;
+    _unlockSwitches();
+    return result;
+}
+
+/**
+ * @brief A command of the call with ticket is done (switches locked); the issuer wakes up with
+ *        the last one. Completions of calls that gave up are dropped.
+ */
+void Switch::_ioCommandDone(uint32_t ticket, bool result) {
+    if (ticket == 0 || ticket != _io_ticket) return;
+    _io_ok &= result;
+    if (_io_waiting > 0 && --_io_waiting == 0) xSemaphoreGive(_io_done);
+}
+
+bool Switch::_executeIoCommand(const KasaIoCommand_t &cmd) {
+    switch (cmd.type) {
+    case KasaIoCommandType_t::kSetRelay:
+        // goes through the command queue of the switch, see _queueWrite()
+        return false;
+
+    case KasaIoCommandType_t::kCancel:
+        _cancelWrite(cmd.id, cmd.seq);
+        return true;
+
+    case KasaIoCommandType_t::kDiscover:
+        _beginDiscovery(cmd.id);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Put a relay change into the command queue of its switch. A change still waiting there
+ *        is replaced, so only the latest target state of a burst is sent to the plug; an issuer
+ *        waiting for the replaced change gets it reported as failed.
+ */
+void Switch::_queueWrite(const KasaIoCommand_t &cmd) {
+    _lockSwitches();
+    if (cmd.id >= kMaxKasaSwitches) {
+        _ioCommandDone(cmd.ticket, false);
+        _unlockSwitches();
+        return;
+    }
+    KasaPendingWrite_t &write = _pending_writes[cmd.id];
+    if (write.pending) {
+#ifdef DEBUG_SWITCH
+        SLOG_DEBUG_PRINTF("Switch %u: queued %s replaced by %s\n", cmd.id, write.state ? "on" : "off", cmd.state ? "on" : "off");
+#endif
+        _ioCommandDone(write.ticket, false);
+    }
+    write.pending = true;
+    write.id = cmd.id;
+    write.state = cmd.state;
+    write.seq = cmd.seq;
+    write.config_gen = cmd.config_gen;
+    write.ticket = cmd.ticket;
+    _unlockSwitches();
+}
+
+/**
+ * @brief Drop the relay change seq of switch id if it is still in the command queue of the
+ *        switch (cancelasync). A change already sent to the plug completes as usual.
+ */
+void Switch::_cancelWrite(uint32_t id, uint32_t seq) {
+    if (id >= kMaxKasaSwitches) return;
+    _lockSwitches();
+    KasaPendingWrite_t &write = _pending_writes[id];
+    if (write.pending && write.seq == seq) {
+        write.pending = false;
+        SLOG_INFO_PRINTF("Switch %u: queued %s cancelled\n", id, write.state ? "on" : "off");
+    } else {
+        SLOG_NOTICE_PRINTF("Switch %u: cancelled change already sent or replaced\n", id);
+    }
+    _unlockSwitches();
+}
+
+/**
+ * @brief Start the queued relay changes as non-blocking requests, concurrently across devices.
+ *        With an inrush delay configured, consecutive starts are spaced by it so the relays
+ *        (and the loads behind them) do not all close at the same instant. A device is only
+ *        written while its poll request is idle, so commands to one plug are serialized and
+ *        never use two sockets at a time.
+ */
+void Switch::_writeDevices() {
+    _lockSwitches();
+    // Queued for a configuration that has been replaced meanwhile
+    for (uint32_t u = 0; u < kMaxKasaSwitches; u++) {
+        if (_pending_writes[u].pending && (_pending_writes[u].config_gen != _config_gen || u >= switches.size())) {
+            _pending_writes[u].pending = false;
+            _completeWrite(_pending_writes[u], false);
+        }
+    }
+
+    for (auto& group : poll_groups) {
+        if (!_hasPendingWrite(group)) continue;
+        // A poll waiting for its retry gives way: the write reads the relay states back
+        if (group.writes.empty() && group.request->IsRetryWait()) group.request->Abort();
+        if (!group.request->IsIdle()) continue;
+        if (_inrush_delay_ms > 0 && static_cast<int32_t>(millis() - _next_write_ms) < 0) break;
+        _startWrite(group);
+        _next_write_ms = millis() + _inrush_delay_ms;
+    }
+    _unlockSwitches();
+}
+
+/**
+ * @brief A relay change of the device is queued (switches locked)
+ */
+bool Switch::_hasPendingWrite(const KasaPollGroup &group) {
+    for (uint32_t u : group.switch_ids) {
+        if (u < kMaxKasaSwitches && _pending_writes[u].pending) return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Move the queued changes of the device with the same target state into its request
+ *        and start it (switches locked). Outlets going to the other state follow with the next
+ *        request to the device.
+ */
+void Switch::_startWrite(KasaPollGroup &group) {
+    std::vector<const KasaPlug*> outlets;
+    uint32_t timeout_ms = g_kasa_pool.GetMinTimeoutMs();
+    group.writes.clear();
+    for (uint32_t u : group.switch_ids) {
+        if (u >= kMaxKasaSwitches || u >= switches.size() || !_pending_writes[u].pending) continue;
+        if (!group.writes.empty() && _pending_writes[u].state != group.writes[0].state) continue;
+        group.writes.push_back(_pending_writes[u]);
+        _pending_writes[u].pending = false;
+        outlets.push_back(&switches[u]);
+        timeout_ms = std::max(timeout_ms, switches[u].timeoutMs());
+    }
+    if (group.writes.empty()) return;
+
+    // The write reads the relay states back; an outstanding UDP poll is not needed anymore
+    group.udp_pending = false;
+    group.broadcast_pending = false;
+    group.write_verify = false;
+    group.write_optimistic = _optimistic_writes;
+    std::string frame = KasaPlug::relayFrame(outlets, group.writes[0].state, !group.write_optimistic);
+    uint8_t retries = _groupOpen(group) ? 0 : kKasaWriteRetries;
+    if (frame.empty() || !group.request->Start(group.address, reinterpret_cast<const uint8_t*>(frame.data()), frame.size(), timeout_ms, retries)) {
+        for (const auto& write : group.writes) _completeWrite(write, false);
+        group.writes.clear();
+    }
+}
+
+/**
+ * @brief Apply the reply to a relay change of the device and complete the writes (switches
+ *        locked). Older firmware may omit get_sysinfo or answer it before the relay moved: then
+ *        a separate get_sysinfo verifies the new states first.
+ * @return true if a switch state was updated
+ */
+bool Switch::_applyWrite(KasaPollGroup &group, int result, JsonDocument &resp_doc, KasaRelayScanner *scanner, uint32_t rtt_ms, bool sample_rtt) {
+    bool updated = false;
+    bool target = group.writes[0].state;
+    // A scanned reply has no set_relay_state err_code: the relay states read back decide
+    if (result == 0 && !group.write_verify && !scanner) {
+        int err_code = resp_doc["system"]["set_relay_state"]["err_code"] | -1;
+        if (err_code != 0) {
+            SLOG_NOTICE_PRINTF("set_relay_state for %zu switch(es) of %s failed: err_code %d\n", group.writes.size(), group.address.c_str(), err_code);
+            result = 7;
+        }
+    }
+
+    bool verified = true;
+    JsonObject sysinfo = resp_doc["system"]["get_sysinfo"];
+    for (const auto& write : group.writes) {
+        if (write.config_gen != _config_gen || write.id >= switches.size()) continue;
+        KasaPlug& plug = switches[write.id];
+        plug.recordResult(result);
+        if (result != 0) continue;
+        if (sample_rtt) plug.sampleRtt(rtt_ms);
+        bool old_state = plug.state;
+        if (group.write_optimistic) {
+            // Acknowledged: take the target state now, the next poll reads it back
+            plug.state = target;
+            plug.state_str = target ? "on" : "off";
+            plug.unverified_state = target ? 1 : 0;
+            plug.unverified_since_ms = millis();
+        } else {
+            bool applied = scanner ? plug.applyRelayStates(*scanner) : !sysinfo.isNull() && plug.applySysinfo(sysinfo);
+            verified &= applied && plug.state == target;
+        }
+        updated |= plug.state != old_state;
+    }
+
+    if (result == 0 && !verified && !group.write_verify) {
+#ifdef DEBUG_SWITCH
+        SLOG_DEBUG_PRINTF("Combined reply from %s not conclusive - verifying with get_sysinfo\n", group.address.c_str());
+#endif
+        group.write_verify = true;
+        _startTcpPoll(group);
+        return updated;
+    }
+
+    if (result == 0) {
+        SLOG_INFO_PRINTF("setswitch %zu switch(es) of %s %s: %u ms%s\n", group.writes.size(), group.address.c_str(),
+                         target ? "on" : "off", static_cast<unsigned>(rtt_ms),
+                         group.write_optimistic ? " (acknowledged, verified by the next poll)" : group.write_verify ? " (verified separately)" : " single round trip");
+    }
+    for (const auto& write : group.writes) {
+        bool ok = result == 0 && write.config_gen == _config_gen && write.id < switches.size() && switches[write.id].state == target;
+        _completeWrite(write, ok);
+    }
+    group.writes.clear();
+    group.write_verify = false;
+    return true;
+}
+
+/**
+ * @brief Report a relay change as done and wake up a waiting issuer (switches locked)
+ */
+void Switch::_completeWrite(const KasaPendingWrite_t &write, bool result) {
+    if (write.config_gen == _config_gen && write.id < kMaxKasaSwitches) {
+        _set_done_seq[write.id] = write.seq;
+        _set_done_ok[write.id] = result;
+        _boostPoll(write.id);
+    }
+    _ioCommandDone(write.ticket, result);
+}
+
+/**
+ * @brief Fail all queued and in-flight relay changes (switches locked)
+ */
+void Switch::_failPendingWrites() {
+    for (auto& group : poll_groups) {
+        if (group.writes.empty()) continue;
+        group.request->Abort();
+        for (const auto& write : group.writes) _completeWrite(write, false);
+        group.writes.clear();
+        group.write_verify = false;
+    }
+    for (uint32_t u = 0; u < kMaxKasaSwitches; u++) {
+        if (!_pending_writes[u].pending) continue;
+        _pending_writes[u].pending = false;
+        _completeWrite(_pending_writes[u], false);
+    }
+}
+
+void Switch::_pollDevices() {
+    bool updated = false;
+    _lockSwitches();
+
+    if (_verify_broadcast) {
+        // Saved switches were just exposed: one broadcast verifies them all at once, devices
+        // that do not answer are polled over TCP concurrently (broadcast_pending fallback)
+        _verify_broadcast = false;
+        _sendBroadcastPoll();
+    } else if (_broadcast_refresh && static_cast<int32_t>(millis() - _next_broadcast_ms) >= 0) {
+        _sendBroadcastPoll();
+    }
+    updated |= _receiveUdpPolls();
+
+    // One get_sysinfo per physical device; strip outlets share the reply. The polls run
+    // concurrently and are only advanced here, so an offline plug never stalls the others.
+    for (auto& group : poll_groups) {
+        KasaRequest& request = *group.request;
+        uint32_t now = millis();
+        if (request.IsIdle() && _hasPendingWrite(group)) {
+            // Waiting for the inrush delay; the write reads the relay states back
+            continue;
+        }
+        if (group.udp_pending) {
+            if (now - group.udp_sent_ms < kKasaUdpPollTimeoutMs) continue;
+#ifdef DEBUG_SWITCH
+            SLOG_DEBUG_PRINTF("No UDP reply from %s - polling over TCP\n", group.address.c_str());
+#endif
+            group.udp_pending = false;
+            _startTcpPoll(group);
+        } else if (group.broadcast_pending) {
+            if (now - _broadcast_sent_ms < kKasaUdpPollTimeoutMs) continue;
+#ifdef DEBUG_SWITCH
+            SLOG_DEBUG_PRINTF("No broadcast reply from %s - polling over TCP\n", group.address.c_str());
+#endif
+            group.broadcast_pending = false;
+            _broadcast_fallbacks++;
+            _startTcpPoll(group);
+        } else if (request.IsIdle()) {
+            if (static_cast<int32_t>(now - group.next_poll_ms) < 0) continue;
+            // With broadcast refresh only breaker probes and the fast polls after a write run per device
+            if (_broadcast_refresh && !_groupOpen(group) && static_cast<int32_t>(group.fast_until_ms - now) <= 0) continue;
+            _countPollStart(group, now);
+            if (group.udp && _sendUdpPoll(group)) continue;
+            _startTcpPoll(group);
+        }
+        if (!request.Poll()) continue;
+
+        uint32_t rtt_ms = request.GetElapsedMs();
+        bool sample_rtt = !request.WasResent();
+        if (!group.writes.empty()) {
+            // Replies too large for the receive buffer were only scanned for the relay states
+            JsonDocument resp_doc;
+            KasaRelayScanner scanner;
+            bool streamed = request.IsStreamed();
+            int result = streamed ? request.Finish(scanner) : request.Finish(resp_doc);
+            updated |= _applyWrite(group, result, resp_doc, streamed ? &scanner : nullptr, rtt_ms, sample_rtt);
+            continue;
+        }
+        KasaRelayScanner scanner;
+        int result = request.Finish(scanner);
+        updated |= _applyPoll(group, result, scanner, rtt_ms, sample_rtt);
+    }
+    updated |= _checkVerification();
+
+    if (updated) _publishSnapshot();
+    _unlockSwitches();
+}
+
+/**
+ * @brief End the presence verification of the saved switches once all of them answered or the
+ *        deadline passed (switches locked). Unanswered plugs stay configured; the breaker
+ *        takes care of them like of any plug that goes offline.
+ * @return true if pending flags were cleared
+ */
+bool Switch::_checkVerification() {
+    if (!_verifying) return false;
+    size_t unanswered = 0;
+    for (const auto& plug : switches) unanswered += plug.pending ? 1 : 0;
+    if (unanswered > 0 && static_cast<int32_t>(millis() - _verify_deadline_ms) < 0) return false;
+
+    for (auto& plug : switches) {
+        if (!plug.pending) continue;
+        plug.pending = false;
+        SLOG_NOTICE_PRINTF("Saved device %s at %s did not answer within %u ms\n", plug.name.c_str(), plug.address.c_str(), kKasaVerifyDeadlineMs);
+    }
+    _verifying = false;
+    SLOG_INFO_PRINTF("Saved switches verified: %u of %u reachable\n",
+                     static_cast<unsigned>(switches.size() - unanswered), static_cast<unsigned>(switches.size()));
+    return true;
+}
+
+/**
+ * @brief Fan a get_sysinfo reply (or error) out to the switches of a device and schedule its
+ *        next poll (switches locked)
+ * @return true if a switch state was updated
+ */
+bool Switch::_applyPoll(KasaPollGroup &group, int result, KasaRelayScanner &scanner, uint32_t rtt_ms, bool sample_rtt) {
+    if (result == 0 && !scanner.HasSysinfo()) result = 5;
+    for (uint32_t u : group.switch_ids) {
+        if (u < switches.size()) switches[u].recordResult(result);
+    }
+    if (result != 0) {
+#ifdef DEBUG_SWITCH
+        SLOG_DEBUG_PRINTF("Poll failed for device %s (%zu switches): error code %d\n", group.address.c_str(), group.switch_ids.size(), result);
+#endif
+        _schedulePoll(group, false);
+        if (_groupOpen(group)) _resolveGroup(group);
+        return false;
+    }
+
+    bool updated = false;
+    bool changed = false;
+    uint32_t poll_start_ms = millis() - rtt_ms;
+    for (uint32_t u : group.switch_ids) {
+        if (u >= switches.size()) continue;
+        KasaPlug& plug = switches[u];
+        // A reply sent before an optimistic write was acknowledged would undo it
+        if (plug.unverified_state >= 0 && static_cast<int32_t>(poll_start_ms - plug.unverified_since_ms) < 0) continue;
+        plug.rtt_ms = rtt_ms;
+        if (sample_rtt) plug.sampleRtt(rtt_ms);
+        bool old_state = plug.state;
+        if (plug.applyRelayStates(scanner)) {
+            if (plug.unverified_state >= 0 && plug.state != (plug.unverified_state == 1)) {
+                _optimistic_mismatches++;
+                SLOG_NOTICE_PRINTF("Optimistic write of %s not confirmed: acknowledged %s, plug reports %s\n",
+                                   plug.name.c_str(), plug.unverified_state == 1 ? "on" : "off", plug.state_str.c_str());
+            }
+            plug.unverified_state = -1;
+            updated = true;
+            changed |= plug.state != old_state;
+#ifdef DEBUG_SWITCH
+            SLOG_DEBUG_PRINTF("Updated switch %u: %s, state: %s\n", u, switches[u].name.c_str(), switches[u].state_str.c_str());
+#endif
+        }
+    }
+    _schedulePoll(group, changed);
+    return updated;
+}
+
+/**
+ * @brief All switches of the device have an open breaker (switches locked)
+ */
+bool Switch::_groupOpen(const KasaPollGroup &group) {
+    bool open = !group.switch_ids.empty();
+    for (uint32_t u : group.switch_ids) {
+        if (u < switches.size()) open &= switches[u].isOpen();
+    }
+    return open;
+}
+
+/**
+ * @brief A poll of the device starts now: half-open its breakers and track the poll rate
+ */
+void Switch::_countPollStart(KasaPollGroup &group, uint32_t now) {
+    for (uint32_t u : group.switch_ids) {
+        if (u < switches.size()) switches[u].probe();
+    }
+    if (group.last_poll_ms != 0) {
+        uint32_t interval_ms = now - group.last_poll_ms;
+        group.avg_poll_interval_ms = group.avg_poll_interval_ms ? (3 * group.avg_poll_interval_ms + interval_ms) / 4 : interval_ms;
+    }
+    group.last_poll_ms = now;
+}
+
+void Switch::_startTcpPoll(KasaPollGroup &group) {
+    // outlets of a strip share the device's round trip time; take the most patient estimate
+    uint32_t timeout_ms = g_kasa_pool.GetMinTimeoutMs();
+    for (uint32_t u : group.switch_ids) {
+        if (u < switches.size()) timeout_ms = std::max(timeout_ms, switches[u].timeoutMs());
+    }
+    const std::string& frame = device_sysinfo_frame();
+    group.request->Start(group.address, reinterpret_cast<const uint8_t*>(frame.data()), frame.size(), timeout_ms, _groupOpen(group) ? 0 : kKasaPollRetries);
+}
+
+/**
+ * @brief Send get_sysinfo to the device as a single unicast datagram; the reply is picked up
+ *        by _receiveUdpPolls(). False if the datagram could not be sent.
+ */
+bool Switch::_sendUdpPoll(KasaPollGroup &group) {
+    if (!_sendDatagram(group.address.c_str())) return false;
+    group.udp_pending = true;
+    group.udp_sent_ms = millis();
+    return true;
+}
+
+/**
+ * @brief Send one get_sysinfo broadcast for all devices; replies are matched by deviceId in
+ *        _receiveUdpPolls(), devices without a reply are polled over TCP after the timeout.
+ *        Devices with an open breaker keep their own probe schedule.
+ */
+void Switch::_sendBroadcastPoll() {
+    uint32_t now = millis();
+    _next_broadcast_ms = now + _broadcast_interval_ms;
+    if (!_sendDatagram("255.255.255.255")) return;
+    _broadcast_sent_ms = now;
+    for (auto& group : poll_groups) {
+        if (!group.request->IsIdle() || group.udp_pending || _groupOpen(group)) continue;
+        group.broadcast_pending = true;
+        _countPollStart(group, now);
+    }
+}
+
+/**
+ * @brief Send get_sysinfo as a datagram from the poll socket
+ */
+bool Switch::_sendDatagram(const char *ip) {
+    if (!_poll_udp_open) _poll_udp_open = _poll_udp.begin(0);
+    if (!_poll_udp_open || !_poll_udp.beginPacket(ip, kKasaPort)) return false;
+
+    // the datagram is the TCP frame without the length prefix
+    const std::string& frame = device_sysinfo_frame();
+    _poll_udp.write(reinterpret_cast<const uint8_t*>(frame.data()) + kKasaFrameHeaderSize, frame.size() - kKasaFrameHeaderSize);
+    return _poll_udp.endPacket();
+}
+
+/**
+ * @brief Match UDP poll replies to their devices (switches locked): unicast replies by source
+ *        IP, broadcast replies by deviceId (by IP for plugs saved without one). A truncated
+ *        unicast reply makes the device fall back to a TCP poll right away.
+ * @return true if a switch state was updated
+ */
+bool Switch::_receiveUdpPolls() {
+    if (!_poll_udp_open) return false;
+    bool updated = false;
+    int len;
+    while ((len = _poll_udp.parsePacket()) > 0) {
+        std::string ip = _poll_udp.remoteIP().toString().c_str();
+        KasaRelayScanner scanner;
+        KasaDecryptReader reader(_poll_udp, len);
+        reader.ScanAll(scanner);
+        _poll_udp.flush();
+        bool complete = scanner.IsComplete() && scanner.HasSysinfo();
+        int result = scanner.GetErrorCode() != 0 ? 7 : 0;
+
+        auto group = std::find_if(poll_groups.begin(), poll_groups.end(),
+                                  [&](const KasaPollGroup& g) { return g.udp_pending && g.address == ip; });
+        if (group != poll_groups.end()) {
+            group->udp_pending = false;
+            if (!complete) {
+#ifdef DEBUG_SWITCH
+                SLOG_DEBUG_PRINTF("Truncated UDP reply from %s (%d bytes) - polling over TCP\n", ip.c_str(), len);
+#endif
+                _startTcpPoll(*group);
+                continue;
+            }
+            updated |= _applyPoll(*group, result, scanner, millis() - group->udp_sent_ms, false);
+            continue;
+        }
+
+        // Broadcast reply; a truncated one leaves the device to the TCP fallback
+        if (!complete) continue;
+        std::string device_id = scanner.GetDeviceId();
+        group = std::find_if(poll_groups.begin(), poll_groups.end(), [&](const KasaPollGroup& g) {
+            return g.request->IsIdle() && !g.udp_pending && (g.device_id.empty() ? g.address == ip : g.device_id == device_id);
+        });
+        if (group == poll_groups.end()) continue; // late reply or a device that is not enabled
+        if (!group->device_id.empty() && group->address != ip) _moveGroup(*group, ip);
+        if (group->broadcast_pending) _broadcast_replies++;
+        group->broadcast_pending = false;
+        updated |= _applyPoll(*group, result, scanner, millis() - _broadcast_sent_ms, false);
+    }
+    return updated;
+}
+
+/**
+ * @brief Look for an unreachable device at another IP (switches locked): a get_sysinfo broadcast
+ *        from the poll socket; _receiveUdpPolls() matches the reply by deviceId and moves the
+ *        device. At most every kKasaResolveMinIntervalMs, only for devices with a deviceId.
+ */
+void Switch::_resolveGroup(KasaPollGroup &group) {
+    uint32_t now = millis();
+    if (group.device_id.empty()) return;
+    if (group.resolve_sent_ms != 0 && now - group.resolve_sent_ms < kKasaResolveMinIntervalMs) return;
+    if (!_sendDatagram("255.255.255.255")) return;
+    group.resolve_sent_ms = now;
+#ifdef DEBUG_SWITCH
+    SLOG_DEBUG_PRINTF("Looking for device %s (last seen at %s)\n", group.device_id.c_str(), group.address.c_str());
+#endif
+}
+
+/**
+ * @brief The device of group answered from ip (switches locked): poll it there from now on,
+ *        keep its switch ids, and hand the new address to the web server task
+ *        (discovered_switches) and to Loop() (NVS)
+ */
+void Switch::_moveGroup(KasaPollGroup &group, const std::string &ip) {
+    SLOG_NOTICE_PRINTF("Device %s moved from %s to %s\n", group.device_id.c_str(), group.address.c_str(), ip.c_str());
+    group.address = ip;
+    group.udp_pending = false;
+    for (uint32_t u : group.switch_ids) {
+        if (u < switches.size()) switches[u].moveTo(ip);
+    }
+    _moved_devices.push_back(KasaMovedDevice_t{group.device_id, ip});
+    _moved_pending = true;
+    _moved_unsaved.push_back(KasaMovedDevice_t{group.device_id, ip});
+    _moved_unsaved_pending = true;
+    _resolved_moves++;
+}
+
+/**
+ * @brief Rewrite the saved address of all entries of device_id, so the plug is found again
+ *        after a reboot even if no client triggers a save
+ */
+void Switch::_persistAddress(const std::string &device_id, const std::string &ip) {
+    Preferences prefs;
+    xSemaphoreTake(_prefs_mutex, portMAX_DELAY);
+    if (!prefs.begin("kasaswitch", false)) {
+        xSemaphoreGive(_prefs_mutex);
+        return;
+    }
+    size_t count = prefs.getUInt("count", 0);
+    for (size_t i = 0; i < count && i < kMaxKasaSwitches; i++) {
+        char key[24];
+        snprintf(key, sizeof(key), "devid_%zu", i);
+        if (device_id != prefs.getString(key, "").c_str()) continue;
+        snprintf(key, sizeof(key), "addr_%zu", i);
+        prefs.putString(key, ip.c_str());
+    }
+    prefs.end();
+    xSemaphoreGive(_prefs_mutex);
+}
+
+/**
+ * @brief Save the addresses of devices the I/O task found at a new IP. Called from the
+ *        Arduino loop(), so flash writes hold up neither the I/O task nor a client request.
+ */
+void Switch::Loop() {
+    if (!_moved_unsaved_pending) return;
+    std::vector<KasaMovedDevice_t> moved;
+    _lockSwitches();
+    moved.swap(_moved_unsaved);
+    _moved_unsaved_pending = false;
+    _unlockSwitches();
+
+    for (const auto& move : moved) _persistAddress(move.device_id, move.address);
+}
+
+/**
+ * @brief Take device moves found by the I/O task over into discovered_switches (web server task)
+ */
+void Switch::_applyMovedDevices() {
+    if (!_moved_pending) return;
+    std::vector<KasaMovedDevice_t> moved;
+    _lockSwitches();
+    moved.swap(_moved_devices);
+    _moved_pending = false;
+    _unlockSwitches();
+
+    for (const auto& move : moved) {
+        for (auto& plug : discovered_switches) {
+            if (plug.device_id == move.device_id) plug.moveTo(move.address);
+        }
+    }
+    discovered_index.Rebuild(discovered_switches);
+}
+
+/**
+ * @brief Schedule the next poll of a device (switches locked). The base interval is the shortest
+ *        poll interval of its switches; it doubles with every poll without a state change (up to
+ *        kKasaMaxPollBackoff times) and is kKasaFastPollIntervalMs for kKasaFastPollWindowMs
+ *        after a switch of the device was written. A device whose breakers are all open is
+ *        only probed after the breaker delay.
+ */
+void Switch::_schedulePoll(KasaPollGroup &group, bool changed) {
+    uint32_t now = millis();
+    uint32_t base_ms = kKasaMaxPollIntervalMs;
+    uint32_t breaker_delay_ms = kKasaBreakerMaxDelayMs;
+    for (uint32_t u : group.switch_ids) {
+        if (u >= switches.size()) continue;
+        base_ms = std::min(base_ms, switches[u].poll_interval_ms);
+        breaker_delay_ms = std::min(breaker_delay_ms, switches[u].breaker_delay_ms);
+    }
+    if (_groupOpen(group)) {
+        group.next_poll_ms = now + breaker_delay_ms;
+        return;
+    }
+    if (changed) group.backoff = 0;
+    else if (group.backoff < kKasaMaxPollBackoff) group.backoff++;
+
+    uint32_t interval_ms = std::min(base_ms << group.backoff, kKasaMaxPollIntervalMs);
+    if (static_cast<int32_t>(group.fast_until_ms - now) > 0) {
+        interval_ms = std::min(interval_ms, kKasaFastPollIntervalMs);
+    }
+    group.next_poll_ms = now + interval_ms;
+}
+
+/**
+ * @brief Poll the device of switch id faster for a while after it was written (switches locked)
+ */
+void Switch::_boostPoll(uint32_t id) {
+    uint32_t now = millis();
+    for (auto& group : poll_groups) {
+        if (std::find(group.switch_ids.begin(), group.switch_ids.end(), id) == group.switch_ids.end()) continue;
+        group.fast_until_ms = now + kKasaFastPollWindowMs;
+        group.backoff = 0;
+        if (static_cast<int32_t>(group.next_poll_ms - (now + kKasaFastPollIntervalMs)) > 0) {
+            group.next_poll_ms = now + kKasaFastPollIntervalMs;
+        }
+        return;
+    }
+}
+
+/**
+ * @brief Publish the relay states into the back buffer and flip buffers (I/O task, switches locked)
+ */
+void Switch::_publishSnapshot() {
+    uint32_t seq = _snapshot_seq.load(std::memory_order_relaxed);
+    KasaSnapshot_t &back = _snapshots[(seq + 1) & 1];
+    back.config_gen = _config_gen;
+    back.count = static_cast<uint32_t>(std::min(switches.size(), kMaxKasaSwitches));
+    for (uint32_t u = 0; u < back.count; u++) {
+        back.switches[u].state = switches[u].state;
+        back.switches[u].updated_ms = switches[u].updated_ms;
+        back.switches[u].set_seq = _set_done_seq[u];
+        back.switches[u].set_ok = _set_done_ok[u];
+        back.switches[u].reachable = !switches[u].isOpen();
+        back.switches[u].pending = switches[u].pending;
+    }
+    _snapshot_seq.store(seq + 1, std::memory_order_release);
+}
+
+/**
+ * @brief Copy the front buffer; retried if the I/O task flipped buffers while copying
+ */
+bool Switch::_readSnapshot(KasaSnapshot_t &snapshot) {
+    for (int attempt = 0; attempt < 3; attempt++) {
+        uint32_t seq = _snapshot_seq.load(std::memory_order_acquire);
+        snapshot = _snapshots[seq & 1];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (_snapshot_seq.load(std::memory_order_relaxed) == seq) return true;
+    }
+    return false;
 }
 
-void Switch::Loop() {
-    for (size_t u = 0; u < switches.size(); u++) {
-        if (switches[u].check()) {
-            SetSwitchValue(u, switches[u].state ? 1.0 : 0.0);
-#ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("Updated switch %zu: %s, state: %s\n", u, switches[u].name.c_str(), switches[u].state_str.c_str());
-#endif
+/**
+ * @brief Apply relay states published by the I/O task (web server task, called by the GET handlers)
+ */
+void Switch::_refreshSwitchDevices() {
+    _applyMovedDevices();
+    KasaSnapshot_t snapshot;
+    if (!_readSnapshot(snapshot) || snapshot.config_gen != _config_gen) return;
+
+    for (uint32_t u = 0; u < snapshot.count && u < GetMaxSwitch(); u++) {
+        const KasaSwitchState_t &sw = snapshot.switches[u];
+        // SetSwitchValue() would clear the cancellation the client has to see
+        if (_async_cancelled[u]) continue;
+        if (_async_pending_seq[u] != 0) {
+            // Keep the requested value and StateChangeComplete == false until the relay change is done
+            if (sw.set_seq != _async_pending_seq[u]) continue;
+            _async_pending_seq[u] = 0;
+            if (!sw.set_ok) {
+                SLOG_NOTICE_PRINTF("Asynchronous set of switch %u (%s) failed\n", u, GetSwitchName(u));
+            }
+            _applied_ms[u] = sw.updated_ms;
+            SetSwitchValue(u, sw.state ? 1.0 : 0.0); // completes the state change
+            continue;
         }
+        if (sw.updated_ms == 0 || sw.updated_ms == _applied_ms[u]) continue;
+        _applied_ms[u] = sw.updated_ms;
+        SetSwitchValue(u, sw.state ? 1.0 : 0.0);
     }
 }
 
-void Switch::Discover() {
-    discovered_switches.clear();
-    switches.clear();
-    SLOG_INFO_PRINTF("Discovering Kasa smart plugs...\n");
-
-    std::vector<KasaPlug> temp_switches;
-
-    WiFiUDP udp;
-    udp.begin(0);
-    std::string disc_json = "{\"system\":{\"get_sysinfo\":{}}}";
-    std::string enc = encrypt(disc_json);
-    unsigned long start = millis();
-    unsigned long last_broadcast = 0;
-    const unsigned long discovery_timeout = 5500;  // Slightly longer to catch stragglers
-    const unsigned long broadcast_interval = 900;  // A bit more frequent broadcasts
-    const unsigned long max_process_time = 80;     // Process packets longer each iteration
-
-    while (millis() - start < discovery_timeout) {
-        unsigned long loop_start = millis();
-        
-        // Feed the watchdog at start of each loop
-        yield();
-        delay(10); // Reduced cooperative delay
-        
-        if (millis() - last_broadcast >= broadcast_interval) {
-            // Yield before network operation
-            yield();
-            udp.beginPacket("255.255.255.255", 9999);
-            udp.write(reinterpret_cast<const uint8_t*>(enc.c_str()), enc.size());
-            udp.endPacket();
-            // Yield after network operation
-            yield();
-#ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("Sent discovery broadcast\n");
-#endif
-            last_broadcast = millis();
-        }
+void Switch::_lockSwitches() {
+    if (_switches_mutex) xSemaphoreTake(_switches_mutex, portMAX_DELAY);
+}
 
-        // Process packets for max 50ms per loop iteration
-    while ((millis() - loop_start < max_process_time) && (millis() - start < discovery_timeout)) {
-            // Yield frequently during packet processing
-            yield();
-            
-            int len = udp.parsePacket();
-            if (len <= 0) {
-                delay(5); // Very short delay if no packet
-                continue;
-            }
-            
-            std::vector<char> buf(len + 1);
-            udp.read(buf.data(), len);
-            buf[len] = '\0';
-            // Yield after UDP read
-            yield();
-            
-            std::string renc(buf.data(), len);
-            std::string rplain = decrypt(renc);
-            // Yield after decryption
-            yield();
-
-            JsonDocument doc;
-            DeserializationError error = deserializeJson(doc, rplain);
-            if (error) {
-#ifdef DEBUG_SWITCH
-                SLOG_DEBUG_PRINTF("Discovery JSON parse error: %s\nRaw response: %s\n", error.c_str(), rplain.c_str());
-#endif
-                continue;
-            }
-            // Yield after JSON parsing
-            yield();
+void Switch::_unlockSwitches() {
+    if (_switches_mutex) xSemaphoreGive(_switches_mutex);
+}
 
-            JsonObject sysinfo = doc["system"]["get_sysinfo"];
-            if (sysinfo.isNull()) {
-#ifdef DEBUG_SWITCH
-                SLOG_DEBUG_PRINTF("No sysinfo in response\n");
-#endif
-                continue;
-            }
+/**
+ * @brief Start a discovery job unless one is running and return its id right away. The I/O
+ *        task scans the network in the background; the web server task takes the found plugs
+ *        over with the next status request (_applyDiscovery()).
+ * @return job id, 0 if the job could not be queued
+ */
+uint32_t Switch::Discover() {
+    _applyDiscovery();
+    if (_discovery_state == KasaDiscoveryState_t::kRunning) return _discovery_job;
+
+    uint32_t job = ++_discovery_job;
+    _discovery_packets = 0;
+    _discovery_devices = 0;
+    _discovery_start_ms = millis();
+    _discovery_state = KasaDiscoveryState_t::kRunning;
+    SLOG_INFO_PRINTF("Discovering Kasa smart plugs (job %u)...\n", job);
+
+    KasaIoCommand_t cmd = {KasaIoCommandType_t::kDiscover, job, false, 0, 0, 0};
+    if (!_io_task) {
+        // No I/O task: scan right here
+        _executeIoCommand(cmd);
+        while (_discovery_state == KasaDiscoveryState_t::kRunning) {
+            _advanceDiscovery();
+            delay(kKasaIoTickMs);
+        }
+        _applyDiscovery();
+    } else if (xQueueSend(_io_queue, &cmd, 0) != pdTRUE) {
+        SLOG_ERROR_PRINTF("Discovery job %u not started: I/O queue full\n", job);
+        _discovery_state = KasaDiscoveryState_t::kIdle;
+        return 0;
+    }
+    return job;
+}
 
-            // Yield before intensive processing
-            yield();
-            
-            std::string alias = sysinfo["alias"].as<std::string>();
-            std::string model = sysinfo["model"].as<std::string>();
-            IPAddress remote = udp.remoteIP();
-            char ip_str[16];
-            snprintf(ip_str, sizeof(ip_str), "%d.%d.%d.%d", remote[0], remote[1], remote[2], remote[3]);
-            std::string host = ip_str;
-            std::string dev_id = sysinfo["deviceId"].as<std::string>();
-
-            // Yield during duplicate check
-            yield();
-            
-            bool is_duplicate = false;
-            for (const auto& device : temp_switches) {
-                if (device.address == host && device.name == alias) {
-                    is_duplicate = true;
-                    break;
-                }
-            }
-            if (is_duplicate) {
-#ifdef DEBUG_SWITCH
-                SLOG_DEBUG_PRINTF("Skipping duplicate device: %s at %s\n", alias.c_str(), host.c_str());
-#endif
-                continue;
-            }
+/**
+ * @brief Open the discovery socket (I/O task); the first broadcast goes out with the next
+ *        _advanceDiscovery()
+ */
+void Switch::_beginDiscovery(uint32_t job) {
+    if (!_discovery_udp_open) _discovery_udp_open = _discovery_udp.begin(0);
+    if (!_discovery_udp_open) {
+        SLOG_ERROR_PRINTF("Discovery job %u: no UDP socket\n", job);
+        _discovery_state = KasaDiscoveryState_t::kFinished;
+        return;
+    }
+    _discovery_found.clear();
+    _discovery_index.Rebuild(_discovery_found);
+    _discovery_start_ms = millis();
+    _discovery_broadcast_ms = millis() - kKasaDiscoveryBroadcastMs;
+}
 
-            if (sysinfo["children"].is<JsonArray>()) {
-                JsonArray children = sysinfo["children"];
-                for (size_t idx = 0; idx < children.size() && temp_switches.size() < kMaxKasaSwitches; ++idx) {
-                    // Feed watchdog very frequently during child processing
-                    yield();
-                    delay(1); // Minimal delay for each child
-                    
-                    JsonObject child = children[idx];
-                    std::string child_alias = child["alias"].as<std::string>();
-                    
-                    // Yield before duplicate check
-                    yield();
-                    
-                    bool child_duplicate = false;
-                    for (const auto& device : temp_switches) {
-                        if (device.address == host && device.name == child_alias && device.is_child && device.child_index == idx) {
-                            child_duplicate = true;
-                            break;
-                        }
-                    }
-                    if (child_duplicate) {
-#ifdef DEBUG_SWITCH
-                        SLOG_DEBUG_PRINTF("Skipping duplicate child plug: %s at %s, index %zu\n", child_alias.c_str(), host.c_str(), idx);
-#endif
-                        continue;
-                    }
-                    temp_switches.push_back(KasaPlug(host, child_alias, model, true, idx, dev_id));
+/**
+ * @brief One step of the running discovery job (I/O task): broadcast every
+ *        kKasaDiscoveryBroadcastMs, take the replies received meanwhile without waiting and
+ *        finish the job after kKasaDiscoveryDurationMs. Results sorted by name.
+ */
+void Switch::_advanceDiscovery() {
+    if (!_discovery_udp_open) return;
+
+    uint32_t now = millis();
+    if (now - _discovery_broadcast_ms >= kKasaDiscoveryBroadcastMs) {
+        const uint8_t* disc_msg = reinterpret_cast<const uint8_t*>(device_sysinfo_frame().data()) + kKasaFrameHeaderSize;
+        size_t disc_len = device_sysinfo_frame().size() - kKasaFrameHeaderSize;
+        _discovery_udp.beginPacket("255.255.255.255", kKasaPort);
+        _discovery_udp.write(disc_msg, disc_len);
+        _discovery_udp.endPacket();
+        _discovery_broadcast_ms = now;
 #ifdef DEBUG_SWITCH
-                    SLOG_DEBUG_PRINTF("Discovered child plug: %s, child_index: %zu, device_id: %s, IP: %s\n",
-                                      child_alias.c_str(), idx, dev_id.c_str(), host.c_str());
+        SLOG_DEBUG_PRINTF("Sent discovery broadcast\n");
 #endif
-                }
-            } else if (temp_switches.size() < kMaxKasaSwitches) {
-                temp_switches.push_back(KasaPlug(host, alias, model));
+    }
+
+    int len;
+    while ((len = _discovery_udp.parsePacket()) > 0) {
+        _discovery_packets++;
+        // Decrypt while parsing the datagram
+        JsonDocument doc;
+        KasaDecryptReader reader(_discovery_udp, len);
+        DeserializationError error = deserializeJson(doc, reader, DeserializationOption::Filter(kasa_reply_filter().as<JsonVariantConst>()));
+        _discovery_udp.flush();
+        if (error) {
 #ifdef DEBUG_SWITCH
-                SLOG_DEBUG_PRINTF("Discovered single plug: %s, device_id: %s, IP: %s\n",
-                                  alias.c_str(), dev_id.c_str(), host.c_str());
+            SLOG_DEBUG_PRINTF("Discovery JSON parse error: %s (%d bytes)\n", error.c_str(), len);
 #endif
-            }
-            
-            // Yield after processing this device
-            yield();
-        }
-        
-        // End of packet processing loop - yield before continuing
-        yield();
-        delay(5); // Reduced delay before next main loop iteration
-    }
-
-    // Send one last discovery broadcast to catch late responders
-    udp.beginPacket("255.255.255.255", 9999);
-    udp.write(reinterpret_cast<const uint8_t*>(enc.c_str()), enc.size());
-    udp.endPacket();
-    unsigned long tail_start = millis();
-    while (millis() - tail_start < 400) {
-        int len = udp.parsePacket();
-        if (len <= 0) {
-            delay(5);
             continue;
         }
-        std::vector<char> buf(len + 1);
-        udp.read(buf.data(), len);
-        buf[len] = '\0';
-        std::string renc(buf.data(), len);
-        std::string rplain = decrypt(renc);
-        JsonDocument doc;
-        if (deserializeJson(doc, rplain)) {
+        JsonObject sysinfo = doc["system"]["get_sysinfo"];
+        if (sysinfo.isNull()) {
+#ifdef DEBUG_SWITCH
+            SLOG_DEBUG_PRINTF("No sysinfo in response\n");
+#endif
             continue;
         }
-        JsonObject sysinfo = doc["system"]["get_sysinfo"];
-        if (sysinfo.isNull()) continue;
-        std::string alias = sysinfo["alias"].as<std::string>();
-        std::string model = sysinfo["model"].as<std::string>();
-        IPAddress remote = udp.remoteIP();
+        IPAddress remote = _discovery_udp.remoteIP();
         char ip_str[16];
         snprintf(ip_str, sizeof(ip_str), "%d.%d.%d.%d", remote[0], remote[1], remote[2], remote[3]);
-        std::string host = ip_str;
-        std::string dev_id = sysinfo["deviceId"].as<std::string>();
-        bool duplicate = false;
-        for (const auto& d : temp_switches) { if (d.address == host && d.name == alias) { duplicate = true; break; } }
-        if (duplicate) continue;
-        if (sysinfo["children"].is<JsonArray>()) {
-            JsonArray children = sysinfo["children"];
-            for (size_t idx = 0; idx < children.size() && temp_switches.size() < kMaxKasaSwitches; ++idx) {
-                JsonObject child = children[idx];
-                std::string child_alias = child["alias"].as<std::string>();
-                bool child_dup = false;
-                for (const auto& d : temp_switches) {
-                    if (d.address == host && d.name == child_alias && d.is_child && d.child_index == (int)idx) { child_dup = true; break; }
-                }
-                if (!child_dup) temp_switches.push_back(KasaPlug(host, child_alias, model, true, (int)idx, dev_id));
-            }
-        } else if (temp_switches.size() < kMaxKasaSwitches) {
-            temp_switches.push_back(KasaPlug(host, alias, model));
-        }
+        _addDiscovered(sysinfo, ip_str);
     }
+    _discovery_devices = _discovery_found.size();
 
-    // Feed watchdog before final processing
-    yield();
+    if (now - _discovery_start_ms < kKasaDiscoveryDurationMs) return;
 
-    // Sort temp_switches by name
-    std::sort(temp_switches.begin(), temp_switches.end(), [](const KasaPlug& a, const KasaPlug& b) {
+    std::sort(_discovery_found.begin(), _discovery_found.end(), [](const KasaPlug& a, const KasaPlug& b) {
         return a.name < b.name;
     });
+    _discovery_udp.stop();
+    _discovery_udp_open = false;
+    SLOG_INFO_PRINTF("Discovery job %u finished: %u replies, %u plugs\n",
+                     _discovery_job.load(), _discovery_packets.load(), _discovery_devices.load());
+    _discovery_state = KasaDiscoveryState_t::kFinished;
+}
+
+/**
+ * @brief Add the plug or the outlets of the power strip that sent sysinfo unless already found
+ */
+void Switch::_addDiscovered(JsonObject sysinfo, const std::string &host) {
+    std::string alias = sysinfo["alias"].as<std::string>();
+    std::string model = sysinfo["model"].as<std::string>();
+    std::string dev_id = sysinfo["deviceId"].as<std::string>();
+
+    if (sysinfo["children"].is<JsonArray>()) {
+        JsonArray children = sysinfo["children"];
+        for (size_t idx = 0; idx < children.size() && _discovery_found.size() < kMaxKasaSwitches; ++idx) {
+            if (_discovery_index.Find(dev_id, host, true, static_cast<int>(idx)) >= 0) continue;
+            std::string child_alias = children[idx]["alias"].as<std::string>();
+            _discovery_found.push_back(KasaPlug(host, child_alias, model, true, static_cast<int>(idx), dev_id));
+            _discovery_index.Add(_discovery_found, _discovery_found.size() - 1);
+#ifdef DEBUG_SWITCH
+            SLOG_DEBUG_PRINTF("Discovered child plug: %s, child_index: %zu, device_id: %s, IP: %s\n",
+                              child_alias.c_str(), idx, dev_id.c_str(), host.c_str());
+#endif
+        }
+        return;
+    }
 
-    // Feed watchdog after sorting
-    yield();
+    if (_discovery_index.Find(dev_id, host, false, -1) >= 0 || _discovery_found.size() >= kMaxKasaSwitches) return;
+    _discovery_found.push_back(KasaPlug(host, alias, model, false, -1, dev_id));
+    _discovery_index.Add(_discovery_found, _discovery_found.size() - 1);
+#ifdef DEBUG_SWITCH
+    SLOG_DEBUG_PRINTF("Discovered single plug: %s, device_id: %s, IP: %s\n",
+                      alias.c_str(), dev_id.c_str(), host.c_str());
+#endif
+}
+
+/**
+ * @brief Take the plugs of a finished discovery job over (web server task). With known plugs
+ *        and merging enabled they are merged in (_mergeDiscovery()), otherwise they replace
+ *        the known plugs and are all enabled.
+ */
+void Switch::_applyDiscovery() {
+    if (_discovery_state != KasaDiscoveryState_t::kFinished) return;
+    _applyMovedDevices();
+
+    if (_discovery_merge && !discovered_switches.empty()) {
+        _mergeDiscovery();
+        _discovery_found.clear();
+        _discovery_state = KasaDiscoveryState_t::kDone;
+        return;
+    }
 
     // Store all discovered switches
-    discovered_switches = std::move(temp_switches);
-    
-    // Feed watchdog after assignment
-    yield();
-    
+    discovered_switches = std::move(_discovery_found);
+    _discovery_found.clear();
+    discovered_index.Rebuild(discovered_switches);
+
     // For fresh discovery via web interface, enable ALL devices by default
     // Do NOT load saved settings - user can configure manually via web interface
     for (auto& plug : discovered_switches) {
         plug.enabled = true;
         SLOG_INFO_PRINTF("Setting %s to enabled by default\n", plug.name.c_str());
     }
-    
-    // Feed watchdog after enabling all
-    yield();
-    
+
     // Update enabled switches based on current configuration
     UpdateEnabledSwitches();
     // Adjust exposed count to the enabled subset
     SetMaxSwitchDevices(enabledSwitchCount);
+    _discovery_state = KasaDiscoveryState_t::kDone;
 
-    // Feed watchdog after updating switches
-    yield();
-
-    udp.stop();
-#ifdef DEBUG_SWITCH
-    SLOG_DEBUG_PRINTF("UDP discovery closed\n");
-#endif
     SLOG_INFO_PRINTF("Found %d Kasa switches (enabled) out of %d discovered\n", static_cast<int>(switches.size()), static_cast<int>(discovered_switches.size()));
 }
 
+/**
+ * @brief Merge a discovery into the known plugs without tearing the live switches down.
+ *        Outlets seen again (KasaPlug::sameOutlet()) get IP and alias changes in place, the
+ *        live switch keeps its id, relay state and health. New outlets are added disabled so
+ *        the switches exposed to clients do not change; missing ones are only marked stale.
+ */
+void Switch::_mergeDiscovery() {
+    size_t added = 0, updated = 0, stale = 0;
+    std::vector<uint32_t> renamed;
+
+    _lockSwitches();
+    KasaPlugIndex live_index;
+    live_index.Rebuild(switches);
+    for (auto& plug : discovered_switches) plug.stale = true;
+    for (auto& plug : switches) plug.stale = true;
+    for (const auto& seen : _discovery_found) {
+        int known = discovered_index.Find(seen);
+        if (known < 0) {
+            if (discovered_switches.size() >= kMaxKasaSwitches) continue;
+            discovered_switches.push_back(seen);
+            discovered_switches.back().enabled = false;
+            discovered_index.Add(discovered_switches, discovered_switches.size() - 1);
+            added++;
+            SLOG_INFO_PRINTF("New Kasa device %s at %s added (disabled)\n", seen.name.c_str(), seen.address.c_str());
+            continue;
+        }
+        int live = live_index.Find(seen);
+        KasaPlug& plug = discovered_switches[known];
+        if (plug.update(seen)) {
+            updated++;
+            SLOG_INFO_PRINTF("Kasa device %s now at %s\n", plug.name.c_str(), plug.address.c_str());
+        }
+        if (live >= 0) {
+            std::string name = switches[live].name;
+            switches[live].update(seen);
+            if (switches[live].name != name) renamed.push_back(static_cast<uint32_t>(live));
+        }
+    }
+    // Addresses and aliases may have changed
+    discovered_index.Rebuild(discovered_switches);
+    for (const auto& plug : discovered_switches) {
+        if (!plug.stale) continue;
+        stale++;
+        SLOG_NOTICE_PRINTF("Kasa device %s at %s not seen by discovery - marked stale\n", plug.name.c_str(), plug.address.c_str());
+    }
+
+    // A device that moved to another IP takes its poll group along; the group keeps its
+    // scheduling state and pending writes
+    for (auto& group : poll_groups) {
+        const KasaPlug& plug = switches[group.switch_ids.front()];
+        if (group.address != plug.address) {
+            SLOG_INFO_PRINTF("Polling %s at %s instead of %s\n", plug.name.c_str(), plug.address.c_str(), group.address.c_str());
+            group.address = plug.address;
+            group.udp_pending = false;
+            group.broadcast_pending = false;
+        }
+        if (group.device_id.empty()) group.device_id = plug.device_id;
+    }
+    _unlockSwitches();
+
+    // Alpaca switch names follow renamed plugs; ids and values stay untouched
+    for (uint32_t id : renamed) {
+        InitSwitchName(id, switches[id].name.c_str());
+    }
+
+    SLOG_INFO_PRINTF("Discovery merged: %u new, %u updated, %u stale, %u switches in service\n",
+                     static_cast<unsigned>(added), static_cast<unsigned>(updated), static_cast<unsigned>(stale), enabledSwitchCount);
+}
+
+/**
+ * @brief Progress of the current discovery job as JSON object
+ */
+void Switch::_discoveryStatus(char *buf, size_t buf_size) {
+    static const char *const kStates[] = {"idle", "running", "running", "done"}; // kFinished: not applied yet
+    KasaDiscoveryState_t state = _discovery_state;
+    uint32_t remaining_ms = 0;
+    if (state == KasaDiscoveryState_t::kRunning || state == KasaDiscoveryState_t::kFinished) {
+        uint32_t elapsed_ms = millis() - _discovery_start_ms;
+        remaining_ms = elapsed_ms < kKasaDiscoveryDurationMs ? kKasaDiscoveryDurationMs - elapsed_ms : 0;
+    }
+    snprintf(buf, buf_size, "{\"JobId\":%u,\"State\":\"%s\",\"Packets\":%u,\"Devices\":%u,\"Remaining_ms\":%u,\"Duration_ms\":%u}",
+             _discovery_job.load(), kStates[static_cast<int>(state)], _discovery_packets.load(), _discovery_devices.load(),
+             remaining_ms, kKasaDiscoveryDurationMs);
+}
+
+/**
+ * Synchronous set: wait for the verified relay state. Asynchronous set (setasync/setasyncvalue):
+ * queue the relay change and return; _refreshSwitchDevices() completes the state change once
+ * the I/O task has reported the result.
+ */
 const bool Switch::_writeSwitchValue(uint32_t id, double value, SwitchAsyncType_t async_type) {
     if (id >= switches.size()) {
         SLOG_DEBUG_PRINTF("Invalid switch ID: %u\n", id);
@@ -537,10 +1578,19 @@ const bool Switch::_writeSwitchValue(uint32_t id, double value, SwitchAsyncType_
     }
 
     bool target_state = value > 0.5;
-    bool result = switches[id].turn(target_state);
-    if (result) {
-        SetSwitchValue(id, target_state ? 1.0 : 0.0);
-        SetStateChangeComplete(id, true);
+    _async_cancelled[id] = false;
+    KasaIoCommand_t cmd = {KasaIoCommandType_t::kSetRelay, id, target_state, ++_set_seq, _config_gen, 0};
+    bool result = false;
+    if (async_type == SwitchAsyncType_t::kAsyncType && _io_task) {
+        result = xQueueSend(_io_queue, &cmd, 0) == pdTRUE;
+        _async_pending_seq[id] = result ? cmd.seq : 0;
+    } else {
+        _async_pending_seq[id] = 0;
+        result = _runIoCommand(cmd);
+        if (result) {
+            SetSwitchValue(id, target_state ? 1.0 : 0.0);
+            SetStateChangeComplete(id, true);
+        }
     }
 
 #ifdef DEBUG_SWITCH
@@ -551,18 +1601,249 @@ const bool Switch::_writeSwitchValue(uint32_t id, double value, SwitchAsyncType_
     return result;
 }
 
+/**
+ * cancelasync: the I/O task drops the relay change if it is still queued. The switch then reports
+ * OperationCancelled until it is set again.
+ */
+void Switch::_cancelAsync(uint32_t id) {
+    if (id >= kMaxKasaSwitches || _async_pending_seq[id] == 0) return;
+    KasaIoCommand_t cmd = {KasaIoCommandType_t::kCancel, id, false, _async_pending_seq[id], _config_gen, 0};
+    if (xQueueSend(_io_queue, &cmd, 0) != pdTRUE) {
+        SLOG_NOTICE_PRINTF("cancelasync of switch %u not passed on: I/O queue full\n", id);
+    }
+    _async_pending_seq[id] = 0;
+    _async_cancelled[id] = true;
+}
+
+/**
+ * GetAllSwitches (Alpaca action): everything a power panel shows for all exposed switches in
+ * one call, served from the published relay states without contacting the plugs
+ */
+bool Switch::_getAllSwitches(std::string &string_response) {
+    _refreshSwitchDevices();
+    KasaSnapshot_t snapshot;
+    bool have_snapshot = _readSnapshot(snapshot) && snapshot.config_gen == _config_gen;
+    uint32_t now = millis();
+
+    JsonDocument switches_doc;
+    JsonArray list = switches_doc.to<JsonArray>();
+    for (uint32_t u = 0; u < GetMaxSwitch(); u++) {
+        JsonObject sw = list.add<JsonObject>();
+        sw["id"] = u;
+        sw["name"] = GetSwitchName(u);
+        sw["description"] = GetSwitchDescription(u);
+        sw["value"] = GetSwitchValue(u);
+        sw["min"] = GetSwitchMinValue(u);
+        sw["max"] = GetSwitchMaxValue(u);
+        sw["step"] = GetSwitchStep(u);
+        sw["can_write"] = GetSwitchCanWrite(u);
+        bool known = have_snapshot && u < snapshot.count && snapshot.switches[u].updated_ms != 0;
+        sw["updated_ms"] = known ? snapshot.switches[u].updated_ms : 0;                     // device uptime
+        sw["age_ms"] = known ? static_cast<int32_t>(now - snapshot.switches[u].updated_ms) : -1; // -1: never read
+        sw["reachable"] = have_snapshot && u < snapshot.count && snapshot.switches[u].reachable;
+        sw["pending"] = !have_snapshot || u >= snapshot.count || snapshot.switches[u].pending; // presence not verified yet
+    }
+
+    // Action values are strings: return the array serialized into one. Names and descriptions
+    // escaped twice can take several times their length, so the value is measured first.
+    std::string json;
+    serializeJson(switches_doc, json);
+    JsonDocument value_doc;
+    value_doc.set(json);
+    string_response.reserve(measureJson(value_doc) + 1);
+    return serializeJson(value_doc, string_response) > 0;
+}
+
+/**
+ * Relay state of a SetMany value: true/on/1 or false/off/0 (any number within the range of the
+ * switch, rounded like setswitchvalue; nan and inf are rejected)
+ * @return 1 on, 0 off, -1 not a valid value
+ */
+static int8_t parseTargetState(const char *value, double min_value, double max_value) {
+    if (strcasecmp(value, "true") == 0 || strcasecmp(value, "on") == 0) return 1;
+    if (strcasecmp(value, "false") == 0 || strcasecmp(value, "off") == 0) return 0;
+    char *end = nullptr;
+    double number = strtod(value, &end);
+    if (end == value || *end != '\0' || !std::isfinite(number) || number < min_value || number > max_value) return -1;
+    return number > 0.5 ? 1 : 0;
+}
+
+/**
+ * Bulk switching (Alpaca action): SetMany with "id=value,id=value,..." as parameters, AllOn and
+ * AllOff for all writable switches. The relay changes are queued together, so the I/O task
+ * starts them concurrently (spaced by the inrush delay) and strip outlets share a request.
+ * The value is a JSON object string with the result per switch id, e.g. {"0":true,"3":false}.
+ */
+const bool Switch::_putAction(const char *const action, const char *const parameters, std::string &string_response) {
+    if (strcasecmp(action, "GetAllSwitches") == 0) {
+        return _getAllSwitches(string_response);
+    }
+    bool set_all = strcasecmp(action, "AllOn") == 0 || strcasecmp(action, "AllOff") == 0;
+    if (!set_all && strcasecmp(action, "SetMany") != 0) {
+        return false;
+    }
+
+    // Target state per switch, -1 if not switched; a switch listed twice takes the last value
+    int8_t targets[kMaxKasaSwitches];
+    memset(targets, -1, sizeof(targets));
+    if (set_all) {
+        bool on_off = strcasecmp(action, "AllOn") == 0;
+        for (uint32_t u = 0; u < GetMaxSwitch() && u < kMaxKasaSwitches; u++) {
+            if (GetSwitchCanWrite(u)) targets[u] = on_off ? 1 : 0;
+        }
+    } else {
+        // Parameters filling the whole buffer may have been cut by the Alpaca server
+        size_t len = strlen(parameters);
+        if (len >= kSwitchActionParametersSize - 1) {
+            SLOG_NOTICE_PRINTF("SetMany: parameters too long (%u characters or more)\n", static_cast<unsigned>(len));
+            return false;
+        }
+        char list[kSwitchActionParametersSize];
+        memcpy(list, parameters, len + 1);
+        bool listed = false;
+        char *save = nullptr;
+        for (char *pair = strtok_r(list, ",; ", &save); pair; pair = strtok_r(nullptr, ",; ", &save)) {
+            char *end = nullptr;
+            unsigned long id = strtoul(pair, &end, 10);
+            bool valid = end != pair && *end == '=' && id < GetMaxSwitch() && id < kMaxKasaSwitches && GetSwitchCanWrite(id);
+            int8_t target = valid ? parseTargetState(end + 1, GetSwitchMinValue(id), GetSwitchMaxValue(id)) : -1;
+            if (target < 0) {
+                SLOG_NOTICE_PRINTF("SetMany: invalid entry '%s'\n", pair);
+                return false;
+            }
+            targets[id] = target;
+            listed = true;
+        }
+        if (!listed) {
+            SLOG_NOTICE_PRINTF("SetMany: no id=value entry in '%s'\n", parameters);
+            return false;
+        }
+    }
+
+    KasaIoCommand_t cmds[kMaxKasaSwitches];
+    size_t count = 0;
+    for (uint32_t u = 0; u < kMaxKasaSwitches; u++) {
+        if (targets[u] < 0) continue;
+        _async_pending_seq[u] = 0;
+        _async_cancelled[u] = false;
+        cmds[count++] = {KasaIoCommandType_t::kSetRelay, u, targets[u] == 1, ++_set_seq, _config_gen, 0};
+    }
+    uint32_t start_ms = millis();
+    bool all_ok = _runIoCommands(cmds, count);
+
+    // The I/O task stored the result of each write before it signalled its completion
+    JsonDocument result_doc;
+    JsonObject results = result_doc.to<JsonObject>();
+    for (size_t i = 0; i < count; i++) {
+        uint32_t id = cmds[i].id;
+        bool ok = all_ok || (_set_done_seq[id] == cmds[i].seq && _set_done_ok[id]);
+        if (ok) {
+            SetSwitchValue(id, cmds[i].state ? 1.0 : 0.0);
+            SetStateChangeComplete(id, true);
+        }
+        char key[8];
+        snprintf(key, sizeof(key), "%u", id);
+        results[key] = ok;
+    }
+    if (all_ok) {
+        SLOG_INFO_PRINTF("%s: %zu switch(es) in %u ms\n", action, count, static_cast<unsigned>(millis() - start_ms));
+    } else {
+        SLOG_NOTICE_PRINTF("%s: not all of %zu switch(es) set in %u ms\n", action, count, static_cast<unsigned>(millis() - start_ms));
+    }
+
+    // Action values are strings: return the object serialized into one
+    std::string json;
+    serializeJson(result_doc, json);
+    JsonDocument value_doc;
+    value_doc.set(json);
+    return serializeJson(value_doc, string_response) > 0;
+}
+
 void Switch::AlpacaReadJson(JsonObject &root) {
     DBG_JSON_PRINTFJ(SLOG_NOTICE, root, "BEGIN (root=<%s>) ...\n", _ser_json_);
     AlpacaSwitch::AlpacaReadJson(root);
 
+    // Kasa transport settings (connection pool)
+    if (JsonObject kasa_transport = root["KasaTransport"]) {
+        g_kasa_pool.SetMaxSockets(kasa_transport["MaxPooledSockets"] | static_cast<uint32_t>(g_kasa_pool.GetMaxSockets()));
+        g_kasa_pool.SetIdleTimeoutMs((kasa_transport["PoolIdleTimeout_s"] | (g_kasa_pool.GetIdleTimeoutMs() / 1000)) * 1000);
+        g_kasa_pool.SetTimeoutLimitsMs(kasa_transport["TimeoutMin_ms"] | g_kasa_pool.GetMinTimeoutMs(),
+                                       kasa_transport["TimeoutMax_ms"] | g_kasa_pool.GetMaxTimeoutMs());
+        SLOG_INFO_PRINTF("Kasa connection pool: max_sockets=%u idle_timeout=%us timeouts=%u..%ums\n",
+                         static_cast<unsigned>(g_kasa_pool.GetMaxSockets()), static_cast<unsigned>(g_kasa_pool.GetIdleTimeoutMs() / 1000),
+                         static_cast<unsigned>(g_kasa_pool.GetMinTimeoutMs()), static_cast<unsigned>(g_kasa_pool.GetMaxTimeoutMs()));
+    }
+
+    // Broadcast refresh
+    if (JsonObject kasa_polling = root["KasaPolling"]) {
+        _lockSwitches();
+        _broadcast_refresh = kasa_polling["BroadcastRefresh"] | _broadcast_refresh;
+        uint32_t interval_ms = kasa_polling["BroadcastInterval_ms"] | _broadcast_interval_ms;
+        _broadcast_interval_ms = std::max(kKasaMinPollIntervalMs, std::min(interval_ms, kKasaMaxPollIntervalMs));
+        if (!_broadcast_refresh) {
+            for (auto& group : poll_groups) group.broadcast_pending = false;
+        }
+        _unlockSwitches();
+        SLOG_INFO_PRINTF("Kasa broadcast refresh: %s interval=%ums\n", _broadcast_refresh ? "on" : "off", static_cast<unsigned>(_broadcast_interval_ms));
+    }
+
+    // Spacing of relay changes to different devices (bulk switching) and optimistic writes
+    if (JsonObject kasa_switching = root["KasaSwitching"]) {
+        uint32_t inrush_delay_ms = kasa_switching["InrushDelay_ms"] | _inrush_delay_ms;
+        _inrush_delay_ms = std::min(inrush_delay_ms, kKasaMaxInrushDelayMs);
+        _optimistic_writes = kasa_switching["OptimisticWrites"] | _optimistic_writes;
+        SLOG_INFO_PRINTF("Kasa switching: inrush delay %ums, optimistic writes %s\n", static_cast<unsigned>(_inrush_delay_ms), _optimistic_writes ? "on" : "off");
+    }
+
+    // Re-discovery merges into the known plugs or replaces them
+    if (JsonObject kasa_discovery = root["KasaDiscovery"]) {
+        _discovery_merge = kasa_discovery["Merge"] | _discovery_merge;
+        SLOG_INFO_PRINTF("Kasa discovery: merge %s\n", _discovery_merge ? "on" : "off");
+    }
+
+    // Poll interval and poll mode per switch, keyed like KasaSwitchSelection
+    JsonObject kasa_poll = root["KasaPollInterval_ms"];
+    JsonObject kasa_udp = root["KasaUdpPoll"];
+    if (kasa_poll || kasa_udp) {
+        bool poll_changed = false;
+        for (size_t i = 0; i < discovered_switches.size(); ++i) {
+            auto& plug = discovered_switches[i];
+            char switch_key[32];
+            selectionKey(plug, i, switch_key, sizeof(switch_key));
+            uint32_t interval_ms = kasa_poll[switch_key] | plug.poll_interval_ms;
+            interval_ms = std::max(kKasaMinPollIntervalMs, std::min(interval_ms, kKasaMaxPollIntervalMs));
+            bool udp_poll = kasa_udp[switch_key] | plug.udp_poll;
+            if (interval_ms != plug.poll_interval_ms || udp_poll != plug.udp_poll) {
+                plug.poll_interval_ms = interval_ms;
+                plug.udp_poll = udp_poll;
+                poll_changed = true;
+            }
+        }
+        if (poll_changed) {
+            _lockSwitches();
+            for (auto& active : switches) {
+                int u = discovered_index.Find(active);
+                if (u < 0) continue;
+                active.poll_interval_ms = discovered_switches[u].poll_interval_ms;
+                active.udp_poll = discovered_switches[u].udp_poll;
+            }
+            for (auto& group : poll_groups) {
+                group.udp = false;
+                for (uint32_t u : group.switch_ids) group.udp |= switches[u].udp_poll;
+            }
+            _unlockSwitches();
+            SaveKasaSwitchSettingsToPersistentStorage();
+            SLOG_INFO_PRINTF("Kasa poll settings updated\n");
+        }
+    }
+
     // Check for discovery trigger
     bool discoveryTrigger = root["KasaDiscoveryTrigger"].as<bool>();
     SLOG_INFO_PRINTF("Checking discovery trigger: %s\n", discoveryTrigger ? "true" : "false");
     
     if (discoveryTrigger) {
         SLOG_INFO_PRINTF("Discovery trigger received - starting Kasa device discovery...\n");
-        Discover();
-        SLOG_INFO_PRINTF("Discovery completed - found %d switches\n", static_cast<int>(discovered_switches.size()));
+        Discover(); // runs in the background, progress via GET discover_kasa
         return; // Exit early after discovery
     }
 
@@ -573,7 +1854,7 @@ void Switch::AlpacaReadJson(JsonObject &root) {
         LoadKasaSwitchSettingsFromPersistentStorage();
         InitializeSwitchesFromMemory();
         SetMaxSwitchDevices(enabledSwitchCount);
-        SLOG_INFO_PRINTF("Re-check completed - %d enabled and reachable switches\n", static_cast<int>(enabledSwitchCount));
+        SLOG_INFO_PRINTF("Re-check started - %d enabled switches, presence verified in the background\n", static_cast<int>(enabledSwitchCount));
         return;
     }
 
@@ -587,69 +1868,29 @@ void Switch::AlpacaReadJson(JsonObject &root) {
 #endif
     if (!enabled_keys.isNull() && enabled_keys.size() > 0) {
         SLOG_INFO_PRINTF("Applying KasaEnabledKeys (%u items)\n", static_cast<unsigned>(enabled_keys.size()));
-        // Build a fast lookup of enabled keys
-        std::vector<std::string> enabled_list;
-        enabled_list.reserve(enabled_keys.size());
+        // Look the posted keys up in the stable key index of discovered_switches
+        std::vector<bool> enabled(discovered_switches.size(), false);
         for (JsonVariant v : enabled_keys) {
-            if (v.is<const char*>()) {
-                const char* s = v.as<const char*>();
-                if (s && *s) enabled_list.emplace_back(s);
-            }
-        }
-        
-        // Debug: Log the received enabled keys
+            const char* key = v.as<const char*>();
+            if (!key || !*key) continue;
+            int u = discovered_index.FindKey(key);
 #ifdef DEBUG_SWITCH
-        SLOG_DEBUG_PRINTF("Received enabled keys: ");
-        for (const auto& key : enabled_list) {
-            SLOG_DEBUG_PRINTF("'%s' ", key.c_str());
-        }
-        SLOG_DEBUG_PRINTF("\n");
+            SLOG_DEBUG_PRINTF("Enabled key '%s' -> %d\n", key, u);
 #endif
-        auto is_enabled = [&enabled_list](const std::string &key) -> bool {
-            for (const auto &k : enabled_list) {
-                if (k == key) return true;
-            }
-            return false;
-        };
+            if (u >= 0) enabled[u] = true;
+        }
 
         bool settings_changed = false;
-        for (auto &plug : discovered_switches) {
-            std::string stable_key = plug.address + "_" + plug.name;
-            if (plug.is_child) {
-                stable_key += "_child_" + std::to_string(plug.child_index);
-            }
-            
-            // Clean up stable_key to match AlpacaWriteJson() format exactly
-            // IMPORTANT: Replace all special characters with underscores to match form data format
-            for (char& c : stable_key) {
-                if (c == ' ' || c == '-' || c == '(' || c == ')' || c == '.') {
-                    c = '_';
-                }
-            }
-            
-            // Remove trailing underscores from stable_key
-            while (!stable_key.empty() && stable_key.back() == '_') {
-                stable_key.pop_back();
-            }
-            
-            // Ensure stable_key is not empty
-            if (stable_key.empty()) {
-                stable_key = "default_key";
-            }
-            
-            bool new_enabled_state = is_enabled(stable_key);
-#ifdef DEBUG_SWITCH
-            SLOG_DEBUG_PRINTF("Checking %s: generated_key='%s' enabled=%s\n", 
-                              plug.name.c_str(), stable_key.c_str(), new_enabled_state ? "true" : "false");
-#endif
-            if (plug.enabled != new_enabled_state) {
-                plug.enabled = new_enabled_state;
+        for (size_t u = 0; u < discovered_switches.size(); ++u) {
+            auto &plug = discovered_switches[u];
+            if (plug.enabled != enabled[u]) {
+                plug.enabled = enabled[u];
                 settings_changed = true;
 #ifdef DEBUG_SWITCH
                 SLOG_DEBUG_PRINTF("Changed %s from %s to %s\n", 
                                   plug.name.c_str(), 
-                                  !new_enabled_state ? "enabled" : "disabled",
-                                  new_enabled_state ? "enabled" : "disabled");
+                                  !plug.enabled ? "enabled" : "disabled",
+                                  plug.enabled ? "enabled" : "disabled");
 #endif
             }
         }
@@ -700,31 +1941,7 @@ void Switch::AlpacaReadJson(JsonObject &root) {
             
             // Create the same clean key format as in AlpacaWriteJson
             char switch_key[32];
-            snprintf(switch_key, sizeof(switch_key), "%s", plug.name.c_str());
-            
-            // Replace spaces and special characters with underscores
-            for (char* p = switch_key; *p; ++p) {
-                if (*p == ' ' || *p == '-' || *p == '(' || *p == ')' || *p == '.') {
-                    *p = '_';
-                }
-            }
-            
-            // Truncate to same length as in AlpacaWriteJson
-            if (strlen(switch_key) > 20) {
-                switch_key[20] = '\0';
-            }
-            
-            // Remove trailing underscores to prevent JavaScript parsing issues
-            size_t len = strlen(switch_key);
-            while (len > 0 && switch_key[len - 1] == '_') {
-                switch_key[len - 1] = '\0';
-                len--;
-            }
-            
-            // Ensure we don't have an empty key
-            if (strlen(switch_key) == 0) {
-                snprintf(switch_key, sizeof(switch_key), "sw%zu", i);
-            }
+            selectionKey(plug, i, switch_key, sizeof(switch_key));
             
             // Prefer the stable key via the posted key map
             String stable_lookup = kasa_key_map[switch_key] | "";
@@ -792,6 +2009,37 @@ void Switch::AlpacaReadJson(JsonObject &root) {
 
 void Switch::AlpacaWriteJson(JsonObject &root) {
     DBG_JSON_PRINTFJ(SLOG_NOTICE, root, "BEGIN root=%s ...\n", _ser_json_);
+    _applyMovedDevices();
+    _applyDiscovery();
+
+    // Kasa transport settings and read-only connection pool counters
+    JsonObject kasa_transport = root["KasaTransport"].to<JsonObject>();
+    kasa_transport["MaxPooledSockets"] = static_cast<uint32_t>(g_kasa_pool.GetMaxSockets());
+    kasa_transport["PoolIdleTimeout_s"] = g_kasa_pool.GetIdleTimeoutMs() / 1000;
+    kasa_transport["TimeoutMin_ms"] = g_kasa_pool.GetMinTimeoutMs();
+    kasa_transport["TimeoutMax_ms"] = g_kasa_pool.GetMaxTimeoutMs();
+    const KasaPoolStats_t &pool_stats = g_kasa_pool.GetStats();
+    JsonObject kasa_pool = root["#KasaConnectionPool"].to<JsonObject>();
+    kasa_pool["OpenSockets"] = static_cast<uint32_t>(g_kasa_pool.GetOpenSockets());
+    kasa_pool["Hits"] = pool_stats.hits;
+    kasa_pool["Misses"] = pool_stats.misses;
+    kasa_pool["Reconnects"] = pool_stats.reconnects;
+    kasa_pool["Evictions"] = pool_stats.evictions;
+
+    // Broadcast refresh settings and read-only counters
+    JsonObject kasa_polling = root["KasaPolling"].to<JsonObject>();
+    kasa_polling["BroadcastRefresh"] = _broadcast_refresh;
+    kasa_polling["BroadcastInterval_ms"] = _broadcast_interval_ms;
+    JsonObject kasa_broadcast = root["#KasaBroadcastRefresh"].to<JsonObject>();
+    kasa_broadcast["Replies"] = _broadcast_replies;
+    kasa_broadcast["Fallbacks"] = _broadcast_fallbacks;
+    root["#KasaResolvedMoves"] = _resolved_moves;
+
+    JsonObject kasa_switching = root["KasaSwitching"].to<JsonObject>();
+    kasa_switching["InrushDelay_ms"] = _inrush_delay_ms;
+    kasa_switching["OptimisticWrites"] = _optimistic_writes;
+    root["#KasaOptimisticMismatches"] = _optimistic_mismatches;
+    root["KasaDiscovery"].to<JsonObject>()["Merge"] = _discovery_merge;
     
     // Only add Kasa Switch Selection section if there are discovered switches
     if (discovered_switches.size() > 0) {
@@ -800,70 +2048,56 @@ void Switch::AlpacaWriteJson(JsonObject &root) {
         JsonObject kasa_key_map = root["_KasaSwitchKeyMapHidden"].to<JsonObject>();
         // Provide a robust array of currently enabled stable keys for clients to POST back
         JsonArray enabled_keys = root["KasaEnabledKeys"].to<JsonArray>();
+        JsonObject kasa_poll = root["KasaPollInterval_ms"].to<JsonObject>();
+        JsonObject kasa_udp = root["KasaUdpPoll"].to<JsonObject>();
         
         for (size_t i = 0; i < discovered_switches.size(); ++i) {
         const auto& plug = discovered_switches[i];
         
         // Create a clean field name using just the switch name
         char switch_key[32];
-        snprintf(switch_key, sizeof(switch_key), "%s", plug.name.c_str());
-        
-        // Replace spaces and special characters with underscores, but keep it shorter
-        for (char* p = switch_key; *p; ++p) {
-            if (*p == ' ' || *p == '-' || *p == '(' || *p == ')' || *p == '.') {
-                *p = '_';
-            }
-        }
-        
-        // Truncate very long names to prevent wrapping
-        if (strlen(switch_key) > 20) {
-            switch_key[20] = '\0';
-        }
-        
-        // Remove trailing underscores to prevent JavaScript parsing issues
-        size_t len = strlen(switch_key);
-        while (len > 0 && switch_key[len - 1] == '_') {
-            switch_key[len - 1] = '\0';
-            len--;
-        }
-        
-        // Ensure we don't have an empty key
-        if (strlen(switch_key) == 0) {
-            snprintf(switch_key, sizeof(switch_key), "sw%zu", i);
-        }
+        selectionKey(plug, i, switch_key, sizeof(switch_key));
         
             // Set the boolean value and map short key to a stable key
             kasa_selection[switch_key] = plug.enabled;
-            // Stable key: address + name + optional child info
-            std::string stable_key = plug.address + "_" + plug.name;
-            if (plug.is_child) {
-                stable_key += "_child_" + std::to_string(plug.child_index);
-            }
-            
-            // Clean up stable_key to prevent trailing underscores and invalid characters
-            // IMPORTANT: Replace dots with underscores to match what gets sent in form data
-            for (char& c : stable_key) {
-                if (c == ' ' || c == '-' || c == '(' || c == ')' || c == '.') {
-                    c = '_';
-                }
-            }
-            
-            // Remove trailing underscores from stable_key
-            while (!stable_key.empty() && stable_key.back() == '_') {
-                stable_key.pop_back();
-            }
-            
-            // Ensure stable_key is not empty
-            if (stable_key.empty()) {
-                stable_key = "sw" + std::to_string(i);
-            }
-            
-            kasa_key_map[switch_key] = stable_key.c_str();
+            kasa_poll[switch_key] = plug.poll_interval_ms;
+            kasa_udp[switch_key] = plug.udp_poll;
+            // Stable key: address + name + optional child info, see KasaPlug::buildKeys()
+            kasa_key_map[switch_key] = plug.stable_key.c_str();
             if (plug.enabled) {
-                enabled_keys.add(stable_key.c_str());
+                enabled_keys.add(plug.stable_key.c_str());
             }
         }
         
+        // Actual poll rate per enabled switch (read-only)
+        JsonObject kasa_poll_rate = root["#KasaPollRate_Hz"].to<JsonObject>();
+        _lockSwitches();
+        for (const auto& group : poll_groups) {
+            float rate_hz = group.avg_poll_interval_ms ? 1000.0f / group.avg_poll_interval_ms : 0.0f;
+            for (uint32_t u : group.switch_ids) {
+                if (u < switches.size()) kasa_poll_rate[switches[u].name] = roundf(rate_hz * 100.0f) / 100.0f;
+            }
+        }
+        _unlockSwitches();
+
+        // Circuit breaker per enabled switch (read-only)
+        JsonObject kasa_health = root["#KasaBreakerState"].to<JsonObject>();
+        JsonObject kasa_error = root["#KasaLastError"].to<JsonObject>();
+        JsonObject kasa_timeout = root["#KasaTimeout_ms"].to<JsonObject>();
+        _lockSwitches();
+        for (const auto& plug : switches) {
+            kasa_health[plug.name] = plug.pending ? "pending" : plug.healthStr();
+            kasa_error[plug.name] = plug.last_error;
+            kasa_timeout[plug.name] = plug.timeoutMs();
+        }
+        _unlockSwitches();
+
+        // Known plugs the last merging discovery did not see (read-only)
+        JsonArray kasa_stale = root["#KasaStale"].to<JsonArray>();
+        for (const auto& plug : discovered_switches) {
+            if (plug.stale) kasa_stale.add(plug.name);
+        }
+
         // IMPORTANT: Also save to persistent storage (NVS) for reboot persistence
         // This ensures the "Save" button saves to both LittleFS AND NVS
         SaveKasaSwitchSettingsToPersistentStorage();
@@ -924,6 +2158,7 @@ void Switch::SaveKasaSwitchSettings(JsonObject &root) {
 }
 
 void Switch::UpdateEnabledSwitches() {
+    _lockSwitches();
     switches.clear();
     
     // Copy only enabled switches to the active switches vector
@@ -935,6 +2170,12 @@ void Switch::UpdateEnabledSwitches() {
     
     // Store enabled switch count
     enabledSwitchCount = static_cast<uint32_t>(switches.size());
+    RebuildPollGroups();
+    _config_gen++;
+    _unlockSwitches();
+    memset(_applied_ms, 0, sizeof(_applied_ms));
+    memset(_async_pending_seq, 0, sizeof(_async_pending_seq));
+    memset(_async_cancelled, 0, sizeof(_async_cancelled));
     
 #ifdef DEBUG_SWITCH
     SLOG_DEBUG_PRINTF("UpdateEnabledSwitches: %u enabled switches out of %zu discovered\n", 
@@ -969,7 +2210,7 @@ void Switch::UpdateEnabledSwitches() {
         InitSwitchMinValue(id, 0.0);
         InitSwitchMaxValue(id, 1.0);
         InitSwitchStep(id, 1.0);
-        InitSwitchCanAsync(id, SwitchAsyncType_t::kNoAsyncType);
+        InitSwitchCanAsync(id, SwitchAsyncType_t::kAsyncType);
         InitSwitchInitBySetup(id, true);  // Only enabled switches are setup
         
 #ifdef DEBUG_SWITCH
@@ -984,24 +2225,53 @@ void Switch::UpdateEnabledSwitches() {
                      static_cast<int>(switches.size()), static_cast<int>(discovered_switches.size()));
 }
 
+/**
+ * @brief Group the switches by device (switches locked). Relay changes queued or in flight for
+ *        the old groups are failed first, so no waiting issuer is left without a completion.
+ */
+void Switch::RebuildPollGroups() {
+    _failPendingWrites();
+    poll_groups.clear();
+    for (uint32_t id = 0; id < switches.size(); ++id) {
+        auto group = std::find_if(poll_groups.begin(), poll_groups.end(),
+                                  [&](const KasaPollGroup& g) { return g.address == switches[id].address; });
+        if (group == poll_groups.end()) {
+            poll_groups.push_back(KasaPollGroup{switches[id].address, {}, std::unique_ptr<KasaRequest>(new KasaRequest())});
+            group = poll_groups.end() - 1;
+        }
+        group->switch_ids.push_back(id);
+        group->udp |= switches[id].udp_poll;
+        if (group->device_id.empty()) group->device_id = switches[id].device_id;
+    }
+#ifdef DEBUG_SWITCH
+    SLOG_DEBUG_PRINTF("RebuildPollGroups: %zu switches on %zu devices\n", switches.size(), poll_groups.size());
+#endif
+}
+
 void Switch::InitializeSwitchesFromMemory() {
     // Only use switches that are saved in memory - no network discovery
     // discovered_switches should already be loaded from persistent storage
-    switches.clear();
-    
-    // Copy only enabled switches from memory to active switches and verify presence quickly
+    // Expose the enabled switches right away; the I/O task verifies their presence concurrently
+    // with its first poll round (see _checkVerification())
+    std::vector<KasaPlug> saved;
     for (const auto& saved_plug : discovered_switches) {
         if (!saved_plug.enabled) continue;
-        KasaPlug tmp = saved_plug;
-        bool present = tmp.check(1);
-        if (present) {
-            switches.push_back(tmp);
-        } else {
-            SLOG_NOTICE_PRINTF("Skipping unreachable saved device: %s at %s\n", saved_plug.name.c_str(), saved_plug.address.c_str());
-        }
+        saved.push_back(saved_plug);
+        saved.back().pending = true;
     }
     
+    _lockSwitches();
+    switches = std::move(saved);
     enabledSwitchCount = static_cast<uint32_t>(switches.size());
+    RebuildPollGroups();
+    _config_gen++;
+    _verifying = enabledSwitchCount > 0;
+    _verify_broadcast = _verifying;
+    _verify_deadline_ms = millis() + kKasaVerifyDeadlineMs;
+    _unlockSwitches();
+    memset(_applied_ms, 0, sizeof(_applied_ms));
+    memset(_async_pending_seq, 0, sizeof(_async_pending_seq));
+    memset(_async_cancelled, 0, sizeof(_async_cancelled));
     
     SLOG_INFO_PRINTF("InitializeSwitchesFromMemory: Found %d enabled switches in memory\n", 
                      static_cast<int>(enabledSwitchCount));
@@ -1034,14 +2304,9 @@ void Switch::InitializeSwitchesFromMemory() {
         InitSwitchMinValue(id, 0.0);
         InitSwitchMaxValue(id, 1.0);
         InitSwitchStep(id, 1.0);
-        InitSwitchCanAsync(id, SwitchAsyncType_t::kNoAsyncType);
+        InitSwitchCanAsync(id, SwitchAsyncType_t::kAsyncType);
         InitSwitchInitBySetup(id, true);
-
-        // Quick presence check to ensure the device is still reachable
-    bool present = plug.check(1);
-        if (!present) {
-            SLOG_NOTICE_PRINTF("Switch %zu (%s) not reachable at init; will still expose but state may be stale\n", id, plug.name.c_str());
-        }
+        SetSwitchValue(id, plug.state ? 1.0 : 0.0);
         
         SLOG_INFO_PRINTF("NINA will see switch %zu: %s at IP %s\n", 
                         id, plug.name.c_str(), plug.address.c_str());
@@ -1092,22 +2357,30 @@ void Switch::LoadKasaSwitchSettingsFromPersistentStorage() {
             snprintf(key, sizeof(key), "en_%zu", i);
             bool enabled = prefs.getBool(key, true);
 
+            snprintf(key, sizeof(key), "poll_%zu", i);
+            uint32_t poll_interval_ms = prefs.getUInt(key, kKasaDefaultPollIntervalMs);
+
+            snprintf(key, sizeof(key), "udp_%zu", i);
+            bool udp_poll = prefs.getBool(key, false);
+
             if (addr.length() == 0 || name.length() == 0) {
                 continue;
             }
 
             KasaPlug plug(addr.c_str(), name.c_str(), model.c_str(), is_child, child_index, device_id.c_str());
             plug.enabled = enabled;
+            plug.poll_interval_ms = poll_interval_ms;
+            plug.udp_poll = udp_poll;
             discovered_switches.push_back(plug);
             SLOG_INFO_PRINTF("Restored device %s: %s\n", plug.name.c_str(), plug.enabled ? "enabled" : "disabled");
         }
+        discovered_index.Rebuild(discovered_switches);
     } else {
         // Post-discovery: merge saved settings with discovered devices
         SLOG_INFO_PRINTF("Post-discovery: Merging saved settings with discovered devices...\n");
         
-        // Create a map of saved settings by unique device identifier
-        std::map<std::string, bool> savedEnabledStates;
-        
+        // Saved entries are matched by outlet identity (KasaPlug::sameOutlet()) through the index
+        std::vector<bool> applied(discovered_switches.size(), false);
         for (size_t i = 0; i < count && i < kMaxKasaSwitches; i++) {
             char key[24];
 
@@ -1123,30 +2396,35 @@ void Switch::LoadKasaSwitchSettingsFromPersistentStorage() {
             snprintf(key, sizeof(key), "cidx_%zu", i);
             int child_index = prefs.getInt(key, -1);
 
-            snprintf(key, sizeof(key), "en_%zu", i);
-            bool enabled = prefs.getBool(key, true);
+            snprintf(key, sizeof(key), "devid_%zu", i);
+            String device_id = prefs.getString(key, "");
 
             if (addr.length() == 0 || name.length() == 0) {
                 continue;
             }
 
-            // Create unique key for this device (same format as used in web interface)
-            std::string stable_key = addr.c_str() + std::string("_") + name.c_str() + (is_child ? (std::string("_child_") + std::to_string(child_index)) : std::string(""));
-            savedEnabledStates[stable_key] = enabled;
+            int u = discovered_index.Find(device_id.c_str(), addr.c_str(), is_child, child_index);
+            if (u < 0) continue;
+
+            auto& plug = discovered_switches[u];
+            snprintf(key, sizeof(key), "en_%zu", i);
+            plug.enabled = prefs.getBool(key, true);
+
+            snprintf(key, sizeof(key), "poll_%zu", i);
+            plug.poll_interval_ms = prefs.getUInt(key, kKasaDefaultPollIntervalMs);
+
+            snprintf(key, sizeof(key), "udp_%zu", i);
+            plug.udp_poll = prefs.getBool(key, false);
+
+            applied[u] = true;
+            SLOG_INFO_PRINTF("Applied saved setting for %s: %s\n", plug.name.c_str(), plug.enabled ? "enabled" : "disabled");
         }
 
-        // Apply saved enabled states to discovered devices, leaving new devices enabled by default
-        for (auto& plug : discovered_switches) {
-            std::string stable_key = plug.address + "_" + plug.name + (plug.is_child ? ("_child_" + std::to_string(plug.child_index)) : "");
-            
-            if (savedEnabledStates.find(stable_key) != savedEnabledStates.end()) {
-                plug.enabled = savedEnabledStates[stable_key];
-                SLOG_INFO_PRINTF("Applied saved setting for %s: %s\n", plug.name.c_str(), plug.enabled ? "enabled" : "disabled");
-            } else {
-                // New device - keep enabled by default
-                plug.enabled = true;
-                SLOG_INFO_PRINTF("New device %s: keeping enabled by default\n", plug.name.c_str());
-            }
+        // New devices stay enabled by default
+        for (size_t u = 0; u < discovered_switches.size(); u++) {
+            if (applied[u]) continue;
+            discovered_switches[u].enabled = true;
+            SLOG_INFO_PRINTF("New device %s: keeping enabled by default\n", discovered_switches[u].name.c_str());
         }
     }
 
@@ -1154,7 +2432,9 @@ void Switch::LoadKasaSwitchSettingsFromPersistentStorage() {
 }
 
 void Switch::SaveKasaSwitchSettingsToPersistentStorage() {
+    _applyMovedDevices();
     Preferences prefs;
+    if (_prefs_mutex) xSemaphoreTake(_prefs_mutex, portMAX_DELAY);
     prefs.begin("kasaswitch", false); // Open in read-write mode
 
     // Clear existing settings
@@ -1190,9 +2470,16 @@ void Switch::SaveKasaSwitchSettingsToPersistentStorage() {
 
         snprintf(key, sizeof(key), "en_%zu", i);
         prefs.putBool(key, p.enabled);
+
+        snprintf(key, sizeof(key), "poll_%zu", i);
+        prefs.putUInt(key, p.poll_interval_ms);
+
+        snprintf(key, sizeof(key), "udp_%zu", i);
+        prefs.putBool(key, p.udp_poll);
     }
 
     prefs.end();
+    if (_prefs_mutex) xSemaphoreGive(_prefs_mutex);
     SLOG_INFO_PRINTF("Kasa switch settings saved to persistent storage\n");
 }
 
@@ -1216,14 +2503,34 @@ void Switch::DebugSwitchDevice(uint32_t id) {
 }
 #endif
 
+/**
+ * @brief Discovery endpoints next to the setup page:
+ *        POST /setup/v1/switch/<n>/discover_kasa starts a job and returns its status at once,
+ *        GET  /setup/v1/switch/<n>/discover_kasa reports the progress of the current job
+ */
+void Switch::RegisterCallbacks() {
+    AlpacaSwitch::RegisterCallbacks();
+
+    char url[64];
+    snprintf(url, sizeof(url), kAlpacaDeviceSetup, _device_type, _device_number, "discover_kasa");
+    this->createCallBackUrl(LHF(_handleDiscoverKasa), HTTP_POST, url, "_handleDiscoverKasa");
+    this->createCallBackUrl(LHF(_handleDiscoveryStatus), HTTP_GET, url, "_handleDiscoveryStatus");
+}
+
 void Switch::_handleDiscoverKasa(AsyncWebServerRequest *request) {
     SLOG_INFO_PRINTF("Discovery endpoint called - starting Kasa device discovery...\n");
-    
-    // Run network discovery
-    Discover();
-    
-    // Send success response
-    request->send(200, "application/json", "{\"status\":\"success\",\"message\":\"Discovery completed\"}");
-    
-    SLOG_INFO_PRINTF("Discovery endpoint completed - found %d switches\n", static_cast<int>(discovered_switches.size()));
-}
\ No newline at end of file
+    if (Discover() == 0) {
+        request->send(503, "application/json", "{\"status\":\"error\",\"message\":\"Kasa I/O queue full\"}");
+        return;
+    }
+    char status[160];
+    _discoveryStatus(status, sizeof(status));
+    request->send(202, "application/json", status);
+}
+
+void Switch::_handleDiscoveryStatus(AsyncWebServerRequest *request) {
+    _applyDiscovery();
+    char status[160];
+    _discoveryStatus(status, sizeof(status));
+    request->send(200, "application/json", status);
+}
@@ -8,12 +8,38 @@
 **************************************************************************************************/
 #pragma once
 #include "AlpacaSwitch.h"
+#include "KasaTransport.h"
 #include <vector>
 #include <string>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 
 // comment/uncomment to enable/disable debugging
 // #define DEBUG_SWITCH
 
+// Maximum number of switches selectable during discovery UI; exposed count will match enabled
+const size_t kMaxKasaSwitches = 15; // hard upper bound for allocation and UI
+
+/**
+ * @brief Circuit breaker state of a plug
+ *        healthy   - polled normally
+ *        suspect   - last request(s) failed, still polled normally
+ *        open      - unreachable; only probed with exponential backoff
+ *        half-open - probe in flight; success closes the breaker, failure reopens it
+ */
+enum struct KasaHealth_t
+{
+    kHealthy,
+    kSuspect,
+    kOpen,
+    kHalfOpen
+};
+
 class KasaPlug {
 public:
     std::string address;
@@ -25,12 +51,176 @@ public:
     bool state;
     std::string state_str;
     bool enabled;  // New: Track if this switch is enabled in configuration
+    uint32_t rtt_ms; // Duration of the last get_sysinfo round trip
+    uint32_t updated_ms; // millis() when the relay state was last read from the plug
+    uint32_t poll_interval_ms; // configured base poll interval
+    bool udp_poll;       // poll with a unicast UDP datagram, TCP only as fallback
+    KasaHealth_t health;
+    uint8_t failures;    // consecutive failed requests
+    int last_error;      // result of the last request: 0 ok, 2 unreachable, 5 read error, 7 Kasa error
+    uint32_t breaker_delay_ms; // probe interval while the breaker is open
+    uint32_t srtt_ms;    // smoothed round trip time, 0 until measured
+    uint32_t rttvar_ms;  // round trip time variation
+    int8_t unverified_state;      // optimistic write: acknowledged state not read back yet, -1 if none
+    uint32_t unverified_since_ms; // millis() of that acknowledgement
+    bool stale;          // not seen by the last merging discovery
+    bool pending;        // restored from NVS and exposed, presence not verified yet
+    uint32_t identity;   // hash of deviceId (address if unknown) and child index, see KasaPlugIndex
+    std::string stable_key; // sanitized address + alias (+ child index) used by the setup page
+
+    // Encrypted, length-prefixed request frames built once by the constructor
+    std::string on_frame;      // set_relay_state on + get_sysinfo
+    std::string off_frame;     // set_relay_state off + get_sysinfo
+    std::string set_on_frame;  // set_relay_state on only (optimistic writes)
+    std::string set_off_frame; // set_relay_state off only (optimistic writes)
 
     KasaPlug(const std::string& addr, const std::string& n, const std::string& m, bool child = false, int index = -1, const std::string& did = "");
-    bool check(int retries = 2);
-    bool turn(bool on_off);
-    bool on() { return turn(true); }
-    bool off() { return turn(false); }
+    std::string childId() const;
+    bool sameOutlet(const std::string &did, const std::string &addr, bool child, int index) const;
+    bool sameOutlet(const KasaPlug &seen) const { return sameOutlet(seen.device_id, seen.address, seen.is_child, seen.child_index); }
+    bool update(const KasaPlug &seen);
+    void moveTo(const std::string &addr);
+    bool applySysinfo(JsonObject sysinfo);
+    bool applyRelayStates(KasaRelayScanner &scanner);
+    void recordResult(int error);
+    void sampleRtt(uint32_t sample_ms);
+    uint32_t timeoutMs() const;
+    void probe();
+    bool isOpen() const { return health == KasaHealth_t::kOpen || health == KasaHealth_t::kHalfOpen; }
+    const char* healthStr() const;
+    static std::string relayFrame(const std::vector<const KasaPlug*> &outlets, bool on_off, bool read_back = true);
+    static uint32_t identityOf(const std::string &id, int index);
+
+private:
+    void buildFrames();
+    void buildKeys();
+};
+
+/**
+ * @brief Hash index over a plug list for O(1) lookups by outlet identity (deviceId + child
+ *        index, address + child index for plugs saved without a deviceId) and by setup page
+ *        stable key. Hash hits are confirmed with KasaPlug::sameOutlet(). Positions are only
+ *        valid until the list changes; call Rebuild() or Add() after modifying it.
+ */
+class KasaPlugIndex
+{
+private:
+    const std::vector<KasaPlug> *_plugs = nullptr;
+    std::unordered_multimap<uint32_t, size_t> _by_identity;
+    std::unordered_map<std::string, size_t> _by_key;
+
+    int _find(uint32_t identity, const std::string &device_id, const std::string &address, bool is_child, int child_index) const;
+
+public:
+    void Rebuild(const std::vector<KasaPlug> &plugs);
+    void Add(const std::vector<KasaPlug> &plugs, size_t u);
+    int Find(const std::string &device_id, const std::string &address, bool is_child, int child_index) const;
+    int Find(const KasaPlug &seen) const { return Find(seen.device_id, seen.address, seen.is_child, seen.child_index); };
+    int FindKey(const char *stable_key) const;
+};
+
+/**
+ * @brief Relay change waiting in the command queue of a switch (Kasa I/O task)
+ */
+struct KasaPendingWrite_t
+{
+    bool pending;
+    uint32_t id;         // switch id
+    bool state;          // latest requested relay state; earlier ones were dropped
+    uint32_t seq;        // KasaIoCommand_t::seq of that request
+    uint32_t config_gen; // KasaIoCommand_t::config_gen of that request
+    uint32_t ticket;     // KasaIoCommand_t::ticket of that request
+};
+
+/**
+ * @brief Enabled switches sharing one physical Kasa device (IP). A power strip is polled
+ *        once per cycle and the reply is fanned out to all its child outlets.
+ */
+struct KasaPollGroup {
+    std::string address;
+    std::vector<uint32_t> switch_ids;     // indices into Switch::switches
+    std::unique_ptr<KasaRequest> request; // get_sysinfo poll or relay change advanced by the Kasa I/O task
+    std::string device_id;                // matches broadcast replies; empty for plugs saved without one
+
+    // poll scheduler
+    uint32_t next_poll_ms = 0;
+    uint32_t fast_until_ms = 0;        // poll fast until then after a write
+    uint8_t backoff = 0;               // interval = base << backoff while nothing changes
+    uint32_t last_poll_ms = 0;
+    uint32_t avg_poll_interval_ms = 0; // measured, for the poll rate on the setup page
+
+    // UDP poll mode
+    bool udp = false;                  // any switch of the device selected UDP polling
+    bool udp_pending = false;          // datagram sent, reply outstanding
+    uint32_t udp_sent_ms = 0;
+    bool broadcast_pending = false;    // expected to answer the last broadcast refresh
+    uint32_t resolve_sent_ms = 0;      // last broadcast looking for the device at another IP
+
+    // relay changes in flight on request, all to the same state
+    std::vector<KasaPendingWrite_t> writes;
+    bool write_verify = false;         // set_relay_state done, request reads the states back
+    bool write_optimistic = false;     // set_relay_state only; the next poll verifies
+};
+
+/**
+ * @brief Device found at a new IP by the I/O task, applied to discovered_switches by the web
+ *        server task
+ */
+struct KasaMovedDevice_t
+{
+    std::string device_id;
+    std::string address;
+};
+
+/**
+ * @brief Work handed to the Kasa I/O task
+ */
+enum struct KasaIoCommandType_t
+{
+    kSetRelay, // turn switch id on/off
+    kCancel,   // drop the queued kSetRelay seq of switch id unless it was sent already
+    kDiscover  // start the background UDP scan of discovery job id
+};
+
+struct KasaIoCommand_t
+{
+    KasaIoCommandType_t type;
+    uint32_t id;                  // kSetRelay: switch id, kDiscover: job id
+    bool state;                   // kSetRelay: requested relay state
+    uint32_t seq;                 // kSetRelay: reported back in KasaSwitchState_t::set_seq, kCancel: kSetRelay to drop
+    uint32_t config_gen;          // kSetRelay: Switch::_config_gen id belongs to
+    uint32_t ticket;              // _runIoCommands() call waiting for completion, 0: nobody waits
+};
+
+/**
+ * @brief Relay states published by the Kasa I/O task for the Alpaca GET handlers
+ */
+struct KasaSwitchState_t
+{
+    bool state;
+    uint32_t updated_ms; // KasaPlug::updated_ms
+    uint32_t set_seq;    // seq of the last completed kSetRelay
+    bool set_ok;         // result of that kSetRelay
+    bool reachable;      // breaker of the plug closed
+    bool pending;        // KasaPlug::pending
+};
+
+/**
+ * @brief State of the background discovery job
+ */
+enum struct KasaDiscoveryState_t : uint8_t
+{
+    kIdle,
+    kRunning,  // I/O task broadcasts and collects the replies
+    kFinished, // scan over; the web server task has not taken the plugs over yet
+    kDone
+};
+
+struct KasaSnapshot_t
+{
+    uint32_t config_gen; // Switch::_config_gen the switch ids belong to
+    uint32_t count;
+    KasaSwitchState_t switches[kMaxKasaSwitches];
 };
 
 class Switch : public AlpacaSwitch
@@ -38,19 +228,25 @@ class Switch : public AlpacaSwitch
 private:
     std::vector<KasaPlug> switches;
     std::vector<KasaPlug> discovered_switches; // All discovered switches (enabled + disabled)
+    std::vector<KasaPollGroup> poll_groups;    // enabled switches grouped by device address
+    KasaPlugIndex discovered_index;            // index of discovered_switches (web server task)
 
     // Alpaca service methods
-    const bool _putAction(const char *const action, const char *const parameters, char *string_response, size_t string_response_size) { return false; }
+    const bool _putAction(const char *const action, const char *const parameters, std::string &string_response);
     const bool _putCommandBlind(const char *const command, const char *const raw, bool &bool_response) { return false; }
     const bool _putCommandBool(const char *const command, const char *const raw, bool &bool_response) { return false; }
     const bool _putCommandString(const char *const command_str, const char *const raw, char *string_response, size_t string_response_size) { return false; }
     const bool _writeSwitchValue(uint32_t id, double value, SwitchAsyncType_t async_type);
+    void _cancelAsync(uint32_t id);
+    bool _getAllSwitches(std::string &string_response);
+    void _refreshSwitchDevices();
 
     void AlpacaReadJson(JsonObject &root);
     void AlpacaWriteJson(JsonObject &root);
     
     // Custom HTTP endpoints
     void _handleDiscoverKasa(AsyncWebServerRequest *request);
+    void _handleDiscoveryStatus(AsyncWebServerRequest *request);
     
     // Helper methods for configuration management
     void LoadKasaSwitchSettings(const JsonObject &root);
@@ -59,6 +255,48 @@ private:
     void SaveKasaSwitchSettingsToPersistentStorage();
     void UpdateEnabledSwitches();
     void InitializeSwitchesFromMemory();
+    void RebuildPollGroups();
+
+    // Kasa I/O task - the only place the plugs are contacted once Begin() has completed
+    static void _ioTask(void *param);
+    bool _runIoCommand(const KasaIoCommand_t &cmd);
+    bool _runIoCommands(const KasaIoCommand_t *cmds, size_t count);
+    void _ioCommandDone(uint32_t ticket, bool result);
+    bool _executeIoCommand(const KasaIoCommand_t &cmd);
+    void _queueWrite(const KasaIoCommand_t &cmd);
+    void _cancelWrite(uint32_t id, uint32_t seq);
+    void _writeDevices();
+    bool _hasPendingWrite(const KasaPollGroup &group);
+    void _startWrite(KasaPollGroup &group);
+    bool _applyWrite(KasaPollGroup &group, int result, JsonDocument &resp_doc, KasaRelayScanner *scanner, uint32_t rtt_ms, bool sample_rtt);
+    void _completeWrite(const KasaPendingWrite_t &write, bool result);
+    void _failPendingWrites();
+    void _pollDevices();
+    bool _checkVerification();
+    void _schedulePoll(KasaPollGroup &group, bool changed);
+    void _boostPoll(uint32_t id);
+    bool _groupOpen(const KasaPollGroup &group);
+    void _countPollStart(KasaPollGroup &group, uint32_t now);
+    void _startTcpPoll(KasaPollGroup &group);
+    bool _sendDatagram(const char *ip);
+    bool _sendUdpPoll(KasaPollGroup &group);
+    void _sendBroadcastPoll();
+    bool _receiveUdpPolls();
+    bool _applyPoll(KasaPollGroup &group, int result, KasaRelayScanner &scanner, uint32_t rtt_ms, bool sample_rtt);
+    void _resolveGroup(KasaPollGroup &group);
+    void _moveGroup(KasaPollGroup &group, const std::string &ip);
+    void _persistAddress(const std::string &device_id, const std::string &ip);
+    void _applyMovedDevices();
+    void _beginDiscovery(uint32_t job);
+    void _advanceDiscovery();
+    void _addDiscovered(JsonObject sysinfo, const std::string &host);
+    void _applyDiscovery();
+    void _mergeDiscovery();
+    void _discoveryStatus(char *buf, size_t buf_size);
+    void _publishSnapshot();
+    bool _readSnapshot(KasaSnapshot_t &snapshot);
+    void _lockSwitches();
+    void _unlockSwitches();
 
 #ifdef DEBUG_SWITCH
     void DebugSwitchDevice(uint32_t id);
@@ -67,11 +305,77 @@ private:
 private:
     uint32_t enabledSwitchCount = 0;  // Track enabled switch count
 
+    TaskHandle_t _io_task = nullptr;
+    QueueHandle_t _io_queue = nullptr;
+    SemaphoreHandle_t _io_done = nullptr;        // completion of waited for commands
+    uint32_t _io_ticket = 0;                     // call waiting in _runIoCommands(), 0: none (switches locked)
+    uint32_t _io_next_ticket = 0;
+    uint32_t _io_waiting = 0;                    // commands of that call not done yet (switches locked)
+    bool _io_ok = true;                          // all of them succeeded so far (switches locked)
+    SemaphoreHandle_t _switches_mutex = nullptr; // switches/poll_groups: web server task vs. I/O task
+    uint32_t _config_gen = 0;                    // incremented whenever switches is rebuilt
+
+    // Presence verification of the saved switches, exposed before their first poll (switches locked)
+    bool _verifying = false;
+    bool _verify_broadcast = false;              // I/O task: verification broadcast not sent yet
+    uint32_t _verify_deadline_ms = 0;            // unanswered saved plugs are reported then
+
+    // Double buffered relay states: written by the I/O task, read lock-free by the GET handlers
+    KasaSnapshot_t _snapshots[2] = {};
+    std::atomic<uint32_t> _snapshot_seq{0};
+    uint32_t _applied_ms[kMaxKasaSwitches] = {}; // updated_ms of the states already applied
+
+    // Asynchronous setswitch (setasync/setasyncvalue)
+    uint32_t _set_seq = 0;                             // web server task: last issued kSetRelay
+    uint32_t _async_pending_seq[kMaxKasaSwitches] = {}; // web server task: awaited kSetRelay, 0 if none
+    bool _async_cancelled[kMaxKasaSwitches] = {};       // web server task: cancelasync, value frozen until the next set
+    uint32_t _set_done_seq[kMaxKasaSwitches] = {};      // I/O task: last completed kSetRelay
+    bool _set_done_ok[kMaxKasaSwitches] = {};
+    KasaPendingWrite_t _pending_writes[kMaxKasaSwitches] = {}; // I/O task: per-switch command queue
+    uint32_t _inrush_delay_ms = 0;                     // spacing of relay changes to different devices
+    uint32_t _next_write_ms = 0;                       // I/O task: earliest start of the next relay change
+    bool _optimistic_writes = false;                   // acknowledge writes without reading the state back
+    uint32_t _optimistic_mismatches = 0;               // optimistic writes contradicted by the next poll
+
+    // UDP poll mode: one socket of the I/O task for all unicast polls
+    WiFiUDP _poll_udp;
+    bool _poll_udp_open = false;
+
+    // Broadcast refresh: one get_sysinfo broadcast per cycle instead of a poll per device
+    bool _broadcast_refresh = false;
+    uint32_t _broadcast_interval_ms = 0;
+    uint32_t _next_broadcast_ms = 0;
+    uint32_t _broadcast_sent_ms = 0;
+    uint32_t _broadcast_replies = 0;   // devices refreshed by a broadcast reply
+    uint32_t _broadcast_fallbacks = 0; // devices polled individually for lack of a reply
+
+    // Re-resolution of unreachable plugs by deviceId
+    std::vector<KasaMovedDevice_t> _moved_devices; // I/O task -> web server task (switches locked)
+    std::atomic<bool> _moved_pending{false};
+    std::vector<KasaMovedDevice_t> _moved_unsaved; // I/O task -> loop(), saved to NVS there (switches locked)
+    std::atomic<bool> _moved_unsaved_pending{false};
+    SemaphoreHandle_t _prefs_mutex = nullptr;      // writes to the "kasaswitch" NVS namespace
+    uint32_t _resolved_moves = 0;                  // devices found at a new IP
+
+    // Background discovery: scanned by the I/O task, progress read by the status endpoint
+    std::atomic<uint32_t> _discovery_job{0};
+    std::atomic<KasaDiscoveryState_t> _discovery_state{KasaDiscoveryState_t::kIdle};
+    std::atomic<uint32_t> _discovery_packets{0};
+    std::atomic<uint32_t> _discovery_devices{0};
+    std::atomic<uint32_t> _discovery_start_ms{0};
+    uint32_t _discovery_broadcast_ms = 0;   // I/O task: last broadcast
+    WiFiUDP _discovery_udp;                 // I/O task
+    bool _discovery_udp_open = false;       // I/O task
+    std::vector<KasaPlug> _discovery_found; // I/O task while running, web server task once finished
+    KasaPlugIndex _discovery_index;         // I/O task: deduplication of _discovery_found
+    bool _discovery_merge = true;           // merge into the known plugs instead of replacing them
+
 public:
     Switch();
     void Begin();
     void Loop();
-    void Discover();
+    uint32_t Discover();
+    void RegisterCallbacks();
     // Expose only enabled switch count to Alpaca clients
     using AlpacaSwitch::SetMaxSwitchDevices;
 };
\ No newline at end of file
@@ -145,7 +145,6 @@ void loop()
 
 #ifdef TEST_SWITCH
   switchDevice.Loop();
-  delay(10);
 #endif
 
   // Yield to allow other tasks to run
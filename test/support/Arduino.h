@@ -0,0 +1,24 @@
+/**************************************************************************************************
+  Filename:       Arduino.h
+  Description:    Minimal Arduino core for the native unit tests of the host independent Kasa
+                  wire format code (KasaProtocol.cpp)
+
+  Copyright 2024-2025. All rights reserved.
+**************************************************************************************************/
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+class Stream
+{
+public:
+    virtual ~Stream() {};
+    virtual size_t readBytes(char *buf, size_t len) = 0;
+};
+
+// Single threaded tests: KasaRxBuffer needs no lock
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
@@ -0,0 +1,53 @@
+/**************************************************************************************************
+  Filename:       KasaFixtures.h
+  Description:    Recorded-style Kasa replies shared by the native tests and benchmarks
+
+  Copyright 2024-2025. All rights reserved.
+**************************************************************************************************/
+#pragma once
+#include <stdio.h>
+#include <string>
+
+const size_t kHs300Outlets = 6;
+static const int kHs300States[kHs300Outlets] = {1, 0, 0, 1, 1, 0}; // children[].state of kasa_hs300_reply()
+static const char kHs300DeviceId[] = "8006AF35494E7DB13DDE9B8F40D5B2C2A1B2C3D4";
+
+/**
+ * @brief get_sysinfo reply of a six outlet HS300 strip, at about 4.7 KB larger than the
+ *        receive buffer. Every outlet carries schedule rules with nested "state" and
+ *        "relay_state" keys, so only children[].state may be picked up.
+ */
+static std::string kasa_hs300_reply()
+{
+    char buf[256];
+    std::string reply =
+        "{\"system\":{\"get_sysinfo\":{\"sw_ver\":\"1.0.21 Build 210524 Rel.161309\",\"hw_ver\":\"2.0\","
+        "\"model\":\"HS300(US)\",\"deviceId\":\"";
+    reply += kHs300DeviceId;
+    reply += "\",\"oemId\":\"32BD0B21AA9BF8E84737D1DB1C66E883\",\"hwId\":\"955F433CBA24823A248A59AA64571A73\","
+             "\"rssi\":-52,\"latitude_i\":473928,\"longitude_i\":85406,\"alias\":\"Observatory strip\","
+             "\"status\":\"new\",\"mic_type\":\"IOT.SMARTPLUGSWITCH\",\"feature\":\"TIM:ENE\","
+             "\"mac\":\"B0:A7:B9:12:34:56\",\"updating\":0,\"led_off\":0,\"children\":[";
+    for (size_t u = 0; u < kHs300Outlets; u++) {
+        snprintf(buf, sizeof(buf), "%s{\"id\":\"%s%02u\",\"state\":%d,\"alias\":\"Outlet %u\",\"on_time\":%u,",
+                 u ? "," : "", kHs300DeviceId, static_cast<unsigned>(u), kHs300States[u], static_cast<unsigned>(u + 1),
+                 kHs300States[u] ? static_cast<unsigned>(3600 + u) : 0u);
+        reply += buf;
+        reply += "\"next_action\":{\"type\":1,\"schedule_sec\":72000,\"action\":";
+        reply += kHs300States[u] ? "0" : "1";
+        reply += ",\"state\":";
+        reply += kHs300States[u] ? "0" : "1";
+        reply += "},\"rule_list\":[";
+        for (int rule = 0; rule < 3; rule++) {
+            snprintf(buf, sizeof(buf),
+                     "%s{\"id\":\"8E6B2F5A4C3D%02u%02d\",\"name\":\"Schedule %d\",\"enable\":1,\"wday\":[1,1,1,1,1,0,0],"
+                     "\"stime_opt\":0,\"smin\":%d,\"sact\":1,\"etime_opt\":-1,\"emin\":0,\"eact\":-1,\"repeat\":1,"
+                     "\"relay_state\":%d}",
+                     rule ? "," : "", static_cast<unsigned>(u), rule, rule + 1, 1080 + 60 * rule, 1 - kHs300States[u]);
+            reply += buf;
+        }
+        reply += "]}";
+    }
+    reply += "],\"child_num\":6,\"ntc_state\":0,\"err_code\":0}}}";
+    return reply;
+}
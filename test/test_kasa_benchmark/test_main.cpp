@@ -0,0 +1,296 @@
+/**************************************************************************************************
+  Filename:       test_main.cpp
+  Description:    Native benchmarks of the Kasa wire format hot paths against the code they
+                  replaced. Results are printed as test messages; the tests only fail if both
+                  variants disagree (pio test -e native -v)
+
+  Copyright 2024-2025. All rights reserved.
+**************************************************************************************************/
+#include <unity.h>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "KasaProtocol.h"
+#include "KasaFixtures.h"
+
+static const char kChildId[] = "8006AF35494E7DB13DDE9B8F40D5B2C200";
+
+static const char kPlugReply[] =
+    "{\"system\":{\"get_sysinfo\":{\"sw_ver\":\"1.0.4\",\"model\":\"HS103(US)\",\"alias\":\"Dew heater\","
+    "\"deviceId\":\"80066B1F1C5D2E3A4B5C6D7E8F90A1B2C3D4E5F6\",\"relay_state\":1,\"on_time\":42,"
+    "\"next_action\":{\"type\":-1,\"relay_state\":0},\"err_code\":0}}}";
+
+static volatile uint32_t g_sink; // keeps the measured loops from being optimized away
+
+// Heap allocations of the whole test program, counted by the operators below
+static size_t g_allocations = 0;
+
+void *operator new(size_t size)
+{
+    g_allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+/**
+ * @brief Average time of one call of fn in ns
+ */
+template <typename Fn>
+static double ns_per_run(size_t runs, Fn fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t u = 0; u < runs; u++) fn();
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / runs;
+}
+
+/**
+ * @brief Heap allocations of one call of fn
+ */
+template <typename Fn>
+static size_t allocations_per_run(Fn fn)
+{
+    size_t before = g_allocations;
+    fn();
+    return g_allocations - before;
+}
+
+static void report(const char *what, double before_ns, double after_ns)
+{
+    char msg[160];
+    snprintf(msg, sizeof(msg), "%s: %.0f ns -> %.0f ns (%.1fx)", what, before_ns, after_ns, before_ns / after_ns);
+    TEST_MESSAGE(msg);
+}
+
+static void report_codec(const char *what, size_t len, double before_ns, double after_ns, size_t before_allocs, size_t after_allocs)
+{
+    char msg[200];
+    snprintf(msg, sizeof(msg), "%s, %zu bytes: %.1f MB/s, %zu allocations -> %.1f MB/s, %zu allocations", what, len,
+             len * 1000.0 / before_ns, before_allocs, len * 1000.0 / after_ns, after_allocs);
+    TEST_MESSAGE(msg);
+}
+
+// The string based codec and copy chain the in-place codec replaced
+static std::string string_encrypt(const std::string &input)
+{
+    std::string result;
+    uint8_t key = kKasaCipherKey;
+    for (char c : input) {
+        uint8_t a = key ^ static_cast<uint8_t>(c);
+        key = a;
+        result += static_cast<char>(a);
+    }
+    return result;
+}
+
+static std::string string_decrypt(const std::string &input)
+{
+    std::string result;
+    uint8_t key = kKasaCipherKey;
+    for (char c : input) {
+        uint8_t a = key ^ static_cast<uint8_t>(c);
+        key = static_cast<uint8_t>(c);
+        result += static_cast<char>(a);
+    }
+    return result;
+}
+
+void setUp() {}
+void tearDown() {}
+
+/**
+ * CPU time per poll: building and encrypting the get_sysinfo frame of a strip outlet for every
+ * request vs. copying the frame KasaPlug::buildFrames() cached when the plug was created
+ */
+void bench_request_frame()
+{
+    auto build = [](uint8_t *frame) {
+        JsonDocument query_doc;
+        JsonObject query = query_doc.to<JsonObject>();
+        query["system"].to<JsonObject>()["get_sysinfo"] = JsonObject();
+        query["context"].to<JsonObject>()["child_ids"].to<JsonArray>().add(kChildId);
+        return kasa_encode_frame(query_doc, frame, kKasaTxFrameSize);
+    };
+    uint8_t frame[kKasaTxFrameSize];
+    size_t cached_len = build(frame);
+    TEST_ASSERT_TRUE(cached_len > 0);
+    std::string cached(reinterpret_cast<char *>(frame), cached_len);
+
+    const size_t runs = 20000;
+    double built_ns = ns_per_run(runs, [&] { g_sink += build(frame); });
+    double cached_ns = ns_per_run(runs, [&] {
+        memcpy(frame, cached.data(), cached.size());
+        g_sink += frame[cached.size() - 1];
+    });
+    TEST_ASSERT_EQUAL_MEMORY(cached.data(), frame, cached.size());
+    report("get_sysinfo frame per poll, built vs. cached", built_ns, cached_ns);
+}
+
+/**
+ * Transmit side: encrypting the serialized request into a string and prepending the length in
+ * another one vs. encrypting in place behind the prefix of the transmit buffer
+ */
+void bench_encrypt_frame()
+{
+    const std::string payload = "{\"system\":{\"set_relay_state\":{\"state\":1},\"get_sysinfo\":{}},"
+                                "\"context\":{\"child_ids\":[\"8006AF35494E7DB13DDE9B8F40D5B2C200\"]}}";
+    std::string message;
+    auto old_encrypt = [&] {
+        std::string enc = string_encrypt(payload);
+        uint8_t prefix[kKasaFrameHeaderSize] = {0, 0, static_cast<uint8_t>(enc.size() >> 8), static_cast<uint8_t>(enc.size())};
+        message.assign(reinterpret_cast<char *>(prefix), sizeof(prefix));
+        message += enc;
+        g_sink += message.back();
+    };
+    uint8_t frame[kKasaTxFrameSize];
+    auto new_encrypt = [&] {
+        size_t len = payload.size();
+        memcpy(frame + kKasaFrameHeaderSize, payload.data(), len);
+        kasa_encrypt(frame + kKasaFrameHeaderSize, len);
+        frame[0] = 0;
+        frame[1] = 0;
+        frame[2] = static_cast<uint8_t>(len >> 8);
+        frame[3] = static_cast<uint8_t>(len);
+        g_sink += frame[kKasaFrameHeaderSize + len - 1];
+    };
+
+    size_t old_allocs = allocations_per_run(old_encrypt);
+    size_t new_allocs = allocations_per_run(new_encrypt);
+    TEST_ASSERT_EQUAL(message.size(), kKasaFrameHeaderSize + payload.size());
+    TEST_ASSERT_EQUAL_MEMORY(message.data(), frame, message.size());
+    TEST_ASSERT_EQUAL(0, new_allocs);
+
+    const size_t runs = 100000;
+    report_codec("encrypt request frame", payload.size(), ns_per_run(runs, old_encrypt), ns_per_run(runs, new_encrypt), old_allocs, new_allocs);
+}
+
+/**
+ * Receive side: the vector -> string -> decrypted string chain of the old send_query() vs.
+ * decrypting the receive buffer in place
+ */
+void bench_decrypt_reply()
+{
+    const size_t len = strlen(kPlugReply);
+    std::vector<uint8_t> received(kPlugReply, kPlugReply + len);
+    kasa_encrypt(received.data(), len);
+
+    std::string plain;
+    auto old_decrypt = [&] {
+        std::vector<uint8_t> renc_vec(received.begin(), received.end());
+        std::string renc(reinterpret_cast<char *>(renc_vec.data()), renc_vec.size());
+        plain = string_decrypt(renc);
+        g_sink += plain.back();
+    };
+    std::vector<uint8_t> rx(kKasaRxFrameSize);
+    auto new_decrypt = [&] {
+        memcpy(rx.data(), received.data(), len); // the socket read, done by both
+        kasa_decrypt(rx.data(), len);
+        g_sink += rx[len - 1];
+    };
+
+    size_t old_allocs = allocations_per_run(old_decrypt);
+    size_t new_allocs = allocations_per_run(new_decrypt);
+    TEST_ASSERT_EQUAL_MEMORY(kPlugReply, plain.data(), len);
+    TEST_ASSERT_EQUAL_MEMORY(kPlugReply, rx.data(), len);
+    TEST_ASSERT_EQUAL(0, new_allocs);
+
+    const size_t runs = 100000;
+    report_codec("decrypt get_sysinfo reply", len, ns_per_run(runs, old_decrypt), ns_per_run(runs, new_decrypt), old_allocs, new_allocs);
+}
+
+/**
+ * Word-parallel kasa_decrypt() vs. the byte-at-a-time loop on a 4.7 KB HS300 reply
+ */
+void bench_decrypt_hs300()
+{
+    std::string reply = kasa_hs300_reply();
+    const size_t len = reply.size();
+    std::vector<uint8_t> enc(reply.begin(), reply.end());
+    kasa_encrypt(enc.data(), len);
+
+    std::vector<uint8_t> byte_buf(len);
+    auto byte_decrypt = [&] {
+        memcpy(byte_buf.data(), enc.data(), len);
+        uint8_t key = kKasaCipherKey;
+        for (size_t u = 0; u < len; u++) {
+            uint8_t c = byte_buf[u];
+            byte_buf[u] = key ^ c;
+            key = c;
+        }
+        g_sink += byte_buf[len - 1];
+    };
+    std::vector<uint8_t> word_buf(len);
+    auto word_decrypt = [&] {
+        memcpy(word_buf.data(), enc.data(), len);
+        kasa_decrypt(word_buf.data(), len);
+        g_sink += word_buf[len - 1];
+    };
+
+    byte_decrypt();
+    word_decrypt();
+    TEST_ASSERT_EQUAL_MEMORY(reply.data(), byte_buf.data(), len);
+    TEST_ASSERT_EQUAL_MEMORY(reply.data(), word_buf.data(), len);
+
+    const size_t runs = 20000;
+    report_codec("decrypt HS300 reply, bytes vs. words", len, ns_per_run(runs, byte_decrypt), ns_per_run(runs, word_decrypt), 0, 0);
+}
+
+/**
+ * Poll reply parsing: filtered deserializeJson() into a JsonDocument vs. KasaRelayScanner, on a
+ * plug reply and on the HS300 reply (which the firmware only scans, it exceeds the receive buffer)
+ */
+static void bench_parse(const char *what, const std::string &reply)
+{
+    DeserializationOption::Filter filter(kasa_reply_filter().as<JsonVariantConst>());
+    int json_state = -1;
+    auto json_parse = [&] {
+        JsonDocument doc;
+        deserializeJson(doc, reply.data(), reply.size(), filter);
+        JsonObject sysinfo = doc["system"]["get_sysinfo"];
+        json_state = sysinfo["children"].isNull() ? (sysinfo["relay_state"] | -1) : (sysinfo["children"][0]["state"] | -1);
+        g_sink += json_state;
+    };
+    int scan_state = -1;
+    auto scan = [&] {
+        KasaRelayScanner scanner;
+        scanner.Feed(reinterpret_cast<const uint8_t *>(reply.data()), reply.size());
+        scan_state = scanner.GetChildCount() ? scanner.GetChild(0).state : scanner.GetRelayState();
+        g_sink += scan_state;
+    };
+
+    size_t json_allocs = allocations_per_run(json_parse);
+    size_t scan_allocs = allocations_per_run(scan);
+    TEST_ASSERT_EQUAL(json_state, scan_state);
+    TEST_ASSERT_EQUAL(0, scan_allocs);
+
+    const size_t runs = 5000;
+    report_codec(what, reply.size(), ns_per_run(runs, json_parse), ns_per_run(runs, scan), json_allocs, scan_allocs);
+}
+
+void bench_parse_plug()
+{
+    bench_parse("parse plug reply, JsonDocument vs. scanner", kPlugReply);
+}
+
+void bench_parse_hs300()
+{
+    bench_parse("parse HS300 reply, JsonDocument vs. scanner", kasa_hs300_reply());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(bench_request_frame);
+    RUN_TEST(bench_encrypt_frame);
+    RUN_TEST(bench_decrypt_reply);
+    RUN_TEST(bench_decrypt_hs300);
+    RUN_TEST(bench_parse_plug);
+    RUN_TEST(bench_parse_hs300);
+    return UNITY_END();
+}
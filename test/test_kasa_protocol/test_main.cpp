@@ -0,0 +1,269 @@
+/**************************************************************************************************
+  Filename:       test_main.cpp
+  Description:    Native unit tests of the Kasa wire format: XOR autokey codec, frame encoding
+                  and KasaRelayScanner (pio test -e native)
+
+  Copyright 2024-2025. All rights reserved.
+**************************************************************************************************/
+#include <unity.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "KasaProtocol.h"
+#include "KasaFixtures.h"
+
+static const char kPlugReply[] =
+    "{\"system\":{\"get_sysinfo\":{\"sw_ver\":\"1.0.4\",\"model\":\"HS103(US)\",\"alias\":\"Dew heater\","
+    "\"deviceId\":\"80066B1F1C5D2E3A4B5C6D7E8F90A1B2C3D4E5F6\",\"relay_state\":1,\"on_time\":42,"
+    "\"next_action\":{\"type\":-1,\"relay_state\":0},\"err_code\":0}}}";
+
+static const char kStripReply[] =
+    "{\"system\":{\"get_sysinfo\":{\"model\":\"HS300(US)\",\"deviceId\":\"8006AF35494E7DB13DDE9B8F40D5B2C2\","
+    "\"children\":[{\"id\":\"8006AF35494E7DB13DDE9B8F40D5B2C200\",\"state\":0,\"alias\":\"Mount\"},"
+    "{\"id\":\"8006AF35494E7DB13DDE9B8F40D5B2C201\",\"state\":1,\"alias\":\"Camera\","
+    "\"next_action\":{\"type\":-1,\"state\":0}}],\"child_num\":2,\"err_code\":0}}}";
+
+static std::vector<uint8_t> encrypted(const char *plain)
+{
+    std::vector<uint8_t> buf(plain, plain + strlen(plain));
+    kasa_encrypt(buf.data(), buf.size());
+    return buf;
+}
+
+static void feed_plain(KasaRelayScanner &scanner, const char *plain, size_t chunk = 0)
+{
+    size_t len = strlen(plain);
+    if (chunk == 0) chunk = len;
+    for (size_t i = 0; i < len; i += chunk) {
+        scanner.Feed(reinterpret_cast<const uint8_t *>(plain) + i, std::min(chunk, len - i));
+    }
+}
+
+class MemoryStream : public Stream
+{
+private:
+    std::vector<uint8_t> _data;
+    size_t _pos = 0;
+
+public:
+    explicit MemoryStream(const std::vector<uint8_t> &data) : _data(data) {};
+    size_t readBytes(char *buf, size_t len) override
+    {
+        len = std::min(len, _data.size() - _pos);
+        memcpy(buf, _data.data() + _pos, len);
+        _pos += len;
+        return len;
+    }
+};
+
+void setUp() {}
+void tearDown() {}
+
+void test_encrypt_known_bytes()
+{
+    std::vector<uint8_t> buf = encrypted("{}");
+    TEST_ASSERT_EQUAL_HEX8(0xd0, buf[0]); // '{' ^ 171
+    TEST_ASSERT_EQUAL_HEX8(0xad, buf[1]); // '}' ^ 0xd0
+}
+
+void test_decrypt_round_trip()
+{
+    std::vector<uint8_t> buf = encrypted(kPlugReply);
+    kasa_decrypt(buf.data(), buf.size());
+    TEST_ASSERT_EQUAL_MEMORY(kPlugReply, buf.data(), strlen(kPlugReply));
+}
+
+void test_decrypt_in_chunks()
+{
+    // Chunk boundaries at every alignment exercise the word loop and the byte head / tail
+    for (size_t chunk = 1; chunk <= 9; chunk++) {
+        std::vector<uint8_t> buf = encrypted(kStripReply);
+        uint8_t key = kKasaCipherKey;
+        for (size_t i = 0; i < buf.size(); i += chunk) {
+            key = kasa_decrypt(buf.data() + i, std::min(chunk, buf.size() - i), key);
+        }
+        TEST_ASSERT_EQUAL_MEMORY(kStripReply, buf.data(), strlen(kStripReply));
+    }
+}
+
+void test_decrypt_hs300_unaligned()
+{
+    // The word loop must not depend on the buffer alignment; 256 byte chunks as read from the socket
+    std::string reply = kasa_hs300_reply();
+    std::vector<uint8_t> enc = encrypted(reply.c_str());
+    for (size_t offset = 0; offset < 4; offset++) {
+        std::vector<uint8_t> buf(offset + enc.size());
+        memcpy(buf.data() + offset, enc.data(), enc.size());
+        uint8_t key = kKasaCipherKey;
+        for (size_t i = 0; i < enc.size(); i += 256) {
+            key = kasa_decrypt(buf.data() + offset + i, std::min(static_cast<size_t>(256), enc.size() - i), key);
+        }
+        TEST_ASSERT_EQUAL_MEMORY(reply.data(), buf.data() + offset, reply.size());
+    }
+}
+
+void test_encode_frame()
+{
+    JsonDocument doc;
+    doc["system"]["get_sysinfo"].to<JsonObject>();
+    uint8_t frame[kKasaTxFrameSize];
+    size_t len = kasa_encode_frame(doc, frame, sizeof(frame));
+    const char *plain = "{\"system\":{\"get_sysinfo\":{}}}";
+    TEST_ASSERT_EQUAL(kKasaFrameHeaderSize + strlen(plain), len);
+    uint32_t payload_len = (static_cast<uint32_t>(frame[0]) << 24) | (static_cast<uint32_t>(frame[1]) << 16) |
+                           (static_cast<uint32_t>(frame[2]) << 8) | frame[3];
+    TEST_ASSERT_EQUAL(strlen(plain), payload_len);
+    kasa_decrypt(frame + kKasaFrameHeaderSize, payload_len);
+    TEST_ASSERT_EQUAL_MEMORY(plain, frame + kKasaFrameHeaderSize, payload_len);
+}
+
+void test_encode_datagram_has_no_prefix()
+{
+    JsonDocument doc;
+    doc["system"]["get_sysinfo"].to<JsonObject>();
+    uint8_t buf[64];
+    size_t len = kasa_encode_datagram(doc, buf, sizeof(buf));
+    std::vector<uint8_t> expected = encrypted("{\"system\":{\"get_sysinfo\":{}}}");
+    TEST_ASSERT_EQUAL(expected.size(), len);
+    TEST_ASSERT_EQUAL_MEMORY(expected.data(), buf, len);
+}
+
+void test_encode_too_large()
+{
+    JsonDocument doc;
+    doc["system"]["get_sysinfo"].to<JsonObject>();
+    uint8_t buf[16];
+    TEST_ASSERT_EQUAL(0, kasa_encode_datagram(doc, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(0, kasa_encode_frame(doc, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(0, kasa_encode_frame(doc, buf, kKasaFrameHeaderSize));
+}
+
+void test_scanner_single_plug()
+{
+    KasaRelayScanner scanner;
+    feed_plain(scanner, kPlugReply);
+    TEST_ASSERT_TRUE(scanner.IsComplete());
+    TEST_ASSERT_TRUE(scanner.HasSysinfo());
+    TEST_ASSERT_EQUAL(0, scanner.GetErrorCode());
+    TEST_ASSERT_EQUAL(1, scanner.GetRelayState()); // next_action.relay_state is ignored
+    TEST_ASSERT_EQUAL_STRING("80066B1F1C5D2E3A4B5C6D7E8F90A1B2C3D4E5F6", scanner.GetDeviceId());
+    TEST_ASSERT_EQUAL(0, scanner.GetChildCount());
+}
+
+void test_scanner_power_strip_byte_by_byte()
+{
+    KasaRelayScanner scanner;
+    feed_plain(scanner, kStripReply, 1);
+    TEST_ASSERT_TRUE(scanner.IsComplete());
+    TEST_ASSERT_EQUAL(-1, scanner.GetRelayState());
+    TEST_ASSERT_EQUAL(2, scanner.GetChildCount());
+    TEST_ASSERT_EQUAL_STRING("8006AF35494E7DB13DDE9B8F40D5B2C200", scanner.GetChild(0).id);
+    TEST_ASSERT_EQUAL(0, scanner.GetChild(0).state);
+    TEST_ASSERT_EQUAL_STRING("8006AF35494E7DB13DDE9B8F40D5B2C201", scanner.GetChild(1).id);
+    TEST_ASSERT_EQUAL(1, scanner.GetChild(1).state);
+}
+
+void test_scanner_hs300_all_children()
+{
+    std::string reply = kasa_hs300_reply();
+    for (size_t chunk : {static_cast<size_t>(1), static_cast<size_t>(256), reply.size()}) {
+        KasaRelayScanner scanner;
+        feed_plain(scanner, reply.c_str(), chunk);
+        TEST_ASSERT_TRUE(scanner.IsComplete());
+        TEST_ASSERT_EQUAL(0, scanner.GetErrorCode());
+        TEST_ASSERT_EQUAL(-1, scanner.GetRelayState()); // rule_list relay_state is ignored
+        TEST_ASSERT_EQUAL_STRING(kHs300DeviceId, scanner.GetDeviceId());
+        TEST_ASSERT_EQUAL(kHs300Outlets, scanner.GetChildCount());
+        for (size_t u = 0; u < kHs300Outlets; u++) {
+            char id[kKasaScanStringSize];
+            snprintf(id, sizeof(id), "%s%02u", kHs300DeviceId, static_cast<unsigned>(u));
+            TEST_ASSERT_EQUAL_STRING(id, scanner.GetChild(u).id);
+            TEST_ASSERT_EQUAL(kHs300States[u], scanner.GetChild(u).state); // next_action.state is ignored
+        }
+    }
+}
+
+void test_scanner_error_codes()
+{
+    KasaRelayScanner root_error;
+    feed_plain(root_error, "{\"error_code\":-2,\"err_msg\":\"member not support\"}");
+    TEST_ASSERT_TRUE(root_error.IsComplete());
+    TEST_ASSERT_FALSE(root_error.HasSysinfo());
+    TEST_ASSERT_EQUAL(-2, root_error.GetErrorCode());
+
+    KasaRelayScanner sysinfo_error;
+    feed_plain(sysinfo_error, "{\"system\":{\"get_sysinfo\":{\"err_code\":-1,\"err_msg\":\"module not support\"}}}");
+    TEST_ASSERT_TRUE(sysinfo_error.IsComplete());
+    TEST_ASSERT_EQUAL(-1, sysinfo_error.GetErrorCode());
+}
+
+void test_scanner_incomplete_and_invalid()
+{
+    KasaRelayScanner truncated;
+    feed_plain(truncated, "{\"system\":{\"get_sysinfo\":{\"relay_state\":1");
+    TEST_ASSERT_FALSE(truncated.IsComplete());
+
+    KasaRelayScanner root_array;
+    feed_plain(root_array, "[{\"relay_state\":1}]");
+    TEST_ASSERT_FALSE(root_array.IsComplete());
+
+    KasaRelayScanner stray_close;
+    feed_plain(stray_close, "}{\"relay_state\":1}");
+    TEST_ASSERT_FALSE(stray_close.IsComplete());
+}
+
+void test_scanner_deep_nesting()
+{
+    // Levels beyond kKasaScanMaxDepth are skipped; the fields around them are still read
+    std::string reply = "{\"system\":{\"get_sysinfo\":{\"deep\":";
+    for (size_t u = 0; u < 2 * kKasaScanMaxDepth; u++) reply += "{\"relay_state\":0,\"a\":[";
+    for (size_t u = 0; u < 2 * kKasaScanMaxDepth; u++) reply += "]}";
+    reply += ",\"relay_state\":1}}}";
+    KasaRelayScanner scanner;
+    feed_plain(scanner, reply.c_str(), 7);
+    TEST_ASSERT_TRUE(scanner.IsComplete());
+    TEST_ASSERT_EQUAL(1, scanner.GetRelayState());
+}
+
+void test_decrypt_reader_scan_all()
+{
+    MemoryStream stream(encrypted(kStripReply));
+    KasaDecryptReader reader(stream, strlen(kStripReply));
+    KasaRelayScanner scanner;
+    TEST_ASSERT_EQUAL(0, reader.ScanAll(scanner));
+    TEST_ASSERT_TRUE(scanner.IsComplete());
+    TEST_ASSERT_EQUAL(2, scanner.GetChildCount());
+}
+
+void test_decrypt_reader_deserialize()
+{
+    MemoryStream stream(encrypted(kPlugReply));
+    KasaDecryptReader reader(stream, strlen(kPlugReply));
+    JsonDocument doc;
+    DeserializationError error = deserializeJson(doc, reader, DeserializationOption::Filter(kasa_reply_filter().as<JsonVariantConst>()));
+    TEST_ASSERT_FALSE(error);
+    TEST_ASSERT_EQUAL_STRING("Dew heater", doc["system"]["get_sysinfo"]["alias"].as<const char *>());
+    TEST_ASSERT_EQUAL(1, doc["system"]["get_sysinfo"]["relay_state"].as<int>());
+    TEST_ASSERT_TRUE(doc["system"]["get_sysinfo"]["on_time"].isNull()); // filtered out
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_encrypt_known_bytes);
+    RUN_TEST(test_decrypt_round_trip);
+    RUN_TEST(test_decrypt_in_chunks);
+    RUN_TEST(test_decrypt_hs300_unaligned);
+    RUN_TEST(test_encode_frame);
+    RUN_TEST(test_encode_datagram_has_no_prefix);
+    RUN_TEST(test_encode_too_large);
+    RUN_TEST(test_scanner_single_plug);
+    RUN_TEST(test_scanner_power_strip_byte_by_byte);
+    RUN_TEST(test_scanner_hs300_all_children);
+    RUN_TEST(test_scanner_error_codes);
+    RUN_TEST(test_scanner_incomplete_and_invalid);
+    RUN_TEST(test_scanner_deep_nesting);
+    RUN_TEST(test_decrypt_reader_scan_all);
+    RUN_TEST(test_decrypt_reader_deserialize);
+    return UNITY_END();
+}